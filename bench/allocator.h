@@ -0,0 +1,158 @@
+#ifndef BENCH_ALLOCATOR_H
+#define BENCH_ALLOCATOR_H
+
+/* the allocator under test, picked by defining one of BENCH_MALLOC_1,
+ * BENCH_MALLOC_2, BENCH_MALLOC_3 or BENCH_SYSTEM. Calls go through the
+ * bench* functions, which make up for what an allocator doesn't have */
+
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#if defined(BENCH_MALLOC_1)
+#include "../malloc_1.cpp"
+const char* const ALLOCATOR_NAME = "malloc_1";
+const bool ALLOCATOR_IS_THREAD_SAFE = false;
+const bool ALLOCATOR_FREES = false;
+#elif defined(BENCH_MALLOC_2)
+#include "../malloc_2.cpp"
+const char* const ALLOCATOR_NAME = "malloc_2";
+const bool ALLOCATOR_IS_THREAD_SAFE = false;
+const bool ALLOCATOR_FREES = true;
+#elif defined(BENCH_MALLOC_3)
+#include "../malloc_3.cpp"
+const char* const ALLOCATOR_NAME = "malloc_3";
+const bool ALLOCATOR_IS_THREAD_SAFE = true;
+const bool ALLOCATOR_FREES = true;
+#elif defined(BENCH_SYSTEM)
+const char* const ALLOCATOR_NAME = "system";
+const bool ALLOCATOR_IS_THREAD_SAFE = true;
+const bool ALLOCATOR_FREES = true;
+#else
+#error "define one of BENCH_MALLOC_1, BENCH_MALLOC_2, BENCH_MALLOC_3, BENCH_SYSTEM"
+#endif
+
+// allocators that aren't thread safe run multi threaded workloads under it
+pthread_mutex_t allocator_mutex = PTHREAD_MUTEX_INITIALIZER;
+bool use_allocator_mutex = false;
+
+void lockAllocator() {
+    if (use_allocator_mutex) {
+        pthread_mutex_lock(&allocator_mutex);
+    }
+}
+
+void unlockAllocator() {
+    if (use_allocator_mutex) {
+        pthread_mutex_unlock(&allocator_mutex);
+    }
+}
+
+void* benchMalloc(size_t size) {
+    lockAllocator();
+#if defined(BENCH_SYSTEM)
+    void* p = malloc(size);
+#else
+    void* p = smalloc(size);
+#endif
+    unlockAllocator();
+
+    return p;
+}
+
+void* benchCalloc(size_t size) {
+#if defined(BENCH_MALLOC_1)
+    // sbrk() memory is zeroed already
+    return benchMalloc(size);
+#else
+    lockAllocator();
+#if defined(BENCH_SYSTEM)
+    void* p = calloc(1, size);
+#else
+    void* p = scalloc(1, size);
+#endif
+    unlockAllocator();
+
+    return p;
+#endif
+}
+
+/* blocks of allocators without aligned allocation are allocated @alignment
+ * bytes larger and used unaligned, as only their footprint matters */
+void* benchAlignedAlloc(size_t alignment, size_t size) {
+#if defined(BENCH_MALLOC_3)
+    void* p = saligned_alloc(alignment, size);
+#elif defined(BENCH_SYSTEM)
+    void* p = NULL;
+    if (posix_memalign(&p, alignment < sizeof(void*) ? sizeof(void*)
+                                                     : alignment, size) != 0) {
+        p = NULL;
+    }
+#else
+    void* p = benchMalloc(size + alignment);
+#endif
+
+    return p;
+}
+
+void benchFree(void* p) {
+    lockAllocator();
+#if defined(BENCH_SYSTEM)
+    free(p);
+#elif !defined(BENCH_MALLOC_1)
+    sfree(p);
+#else
+    // malloc_1 never frees
+    (void)p;
+#endif
+    unlockAllocator();
+}
+
+// @old_size is needed by allocators without realloc
+void* benchRealloc(void* p, size_t old_size, size_t size) {
+#if defined(BENCH_MALLOC_1)
+    void* new_p = benchMalloc(size);
+    if (new_p != NULL && p != NULL) {
+        memcpy(new_p, p, old_size < size ? old_size : size);
+    }
+    return new_p;
+#else
+    (void)old_size;
+    lockAllocator();
+#if defined(BENCH_SYSTEM)
+    void* new_p = realloc(p, size);
+#else
+    void* new_p = srealloc(p, size);
+#endif
+    unlockAllocator();
+
+    return new_p;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+// the benchmarks' own memory comes from mmap(), to stay off the allocator
+void* mapMemory(size_t size) {
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    return addr;
+}
+
+uint64_t getTimeNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif // BENCH_ALLOCATOR_H
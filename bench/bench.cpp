@@ -0,0 +1,376 @@
+/* allocator microbenchmarks. One binary is built per allocator by defining
+ * one of BENCH_MALLOC_1, BENCH_MALLOC_2, BENCH_MALLOC_3 or BENCH_SYSTEM, see
+ * run.sh. Usage:
+ *
+ *     bench_<allocator> <workload> [threads] [ops per thread]
+ *
+ * workloads: fixed, random, realloc, larson, threadtest, cache-scratch.
+ * Prints one JSON line with the throughput, the latency percentiles of
+ * every 16th operation and the peak RSS of the process */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include "allocator.h"
+
+// ----------------------------------------------------------------------------
+
+// every LATENCY_SAMPLE_PERIOD-th operation is timed on its own
+const size_t LATENCY_SAMPLE_PERIOD = 16;
+
+class ThreadContext {
+public:
+    pthread_t thread;
+    size_t index;
+    size_t ops_count;
+    uint64_t random_state;
+    uint64_t* latencies;
+    size_t latencies_count;
+    void** slots;
+    size_t slots_count;
+    // set if the allocator returned NULL
+    bool failed;
+
+    uint64_t nextRandom();
+
+    // log-uniform in [min_size, max_size], like real object sizes
+    size_t randomSize(size_t min_size, size_t max_size);
+
+    bool isTimedOp(size_t op_index);
+
+    void recordLatency(uint64_t start_ns);
+};
+
+uint64_t ThreadContext::nextRandom() {
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+
+    return random_state * 0x2545f4914f6cdd1d;
+}
+
+size_t ThreadContext::randomSize(size_t min_size, size_t max_size) {
+    size_t max_shift = 0;
+    while ((min_size << (max_shift + 1)) <= max_size) {
+        max_shift++;
+    }
+
+    size_t low = min_size << (nextRandom() % (max_shift + 1));
+    size_t high = std::min(2 * low, max_size);
+
+    return low + nextRandom() % (high - low + 1);
+}
+
+bool ThreadContext::isTimedOp(size_t op_index) {
+    return op_index % LATENCY_SAMPLE_PERIOD == 0;
+}
+
+void ThreadContext::recordLatency(uint64_t start_ns) {
+    latencies[latencies_count++] = getTimeNs() - start_ns;
+}
+
+// replace @slot with a new object of @size bytes, touching its first byte
+void replaceObject(ThreadContext& context, void*& slot, size_t size) {
+    benchFree(slot);
+    slot = benchMalloc(size);
+    if (slot == NULL) {
+        context.failed = true;
+        return;
+    }
+    *(char*)slot = (char)size;
+}
+
+// ----------------------------------------------------------------------------
+
+// workloads. Each runs ops_count operations in the calling thread
+
+pthread_barrier_t larson_barrier;
+ThreadContext* contexts;
+size_t threads_count;
+
+// a ring of 64 bytes objects, freed in the order they were allocated
+void runFixed(ThreadContext& context) {
+    for (size_t i = 0; i < context.ops_count && !context.failed; i++) {
+        void*& slot = context.slots[i % context.slots_count];
+        uint64_t start_ns = context.isTimedOp(i) ? getTimeNs() : 0;
+        replaceObject(context, slot, 64);
+        if (start_ns != 0) {
+            context.recordLatency(start_ns);
+        }
+    }
+}
+
+// objects of 16 to 4096 bytes replaced in random order
+void runRandom(ThreadContext& context) {
+    for (size_t i = 0; i < context.ops_count && !context.failed; i++) {
+        void*& slot = context.slots[context.nextRandom() % context.slots_count];
+        size_t size = context.randomSize(16, 4096);
+        uint64_t start_ns = context.isTimedOp(i) ? getTimeNs() : 0;
+        replaceObject(context, slot, size);
+        if (start_ns != 0) {
+            context.recordLatency(start_ns);
+        }
+    }
+}
+
+// buffers grown by half their size from 16 bytes to 1 MB, then freed
+void runRealloc(ThreadContext& context) {
+    void* buffer = NULL;
+    size_t size = 0;
+    for (size_t i = 0; i < context.ops_count && !context.failed; i++) {
+        size_t new_size = size < 16 ? 16 : size + size / 2;
+        if (new_size > 1024 * 1024) {
+            benchFree(buffer);
+            buffer = NULL;
+            size = 0;
+            continue;
+        }
+
+        uint64_t start_ns = context.isTimedOp(i) ? getTimeNs() : 0;
+        void* new_buffer = benchRealloc(buffer, size, new_size);
+        if (start_ns != 0) {
+            context.recordLatency(start_ns);
+        }
+        if (new_buffer == NULL) {
+            context.failed = true;
+            break;
+        }
+        buffer = new_buffer;
+        size = new_size;
+        ((char*)buffer)[size - 1] = 1;
+    }
+
+    benchFree(buffer);
+}
+
+/* server simulation after larson: every thread replaces random objects of
+ * 16 to 1024 bytes, then hands its objects to the next thread. So objects
+ * are often freed by another thread than the one that allocated them */
+void runLarson(ThreadContext& context) {
+    const size_t rounds_count = 10;
+    size_t round_ops_count = context.ops_count / rounds_count;
+
+    size_t op_index = 0;
+    for (size_t round = 0; round < rounds_count; round++) {
+        for (size_t i = 0; i < round_ops_count && !context.failed; i++) {
+            void*& slot =
+                    context.slots[context.nextRandom() % context.slots_count];
+            size_t size = context.randomSize(16, 1024);
+            uint64_t start_ns = context.isTimedOp(op_index++) ? getTimeNs() : 0;
+            replaceObject(context, slot, size);
+            if (start_ns != 0) {
+                context.recordLatency(start_ns);
+            }
+        }
+
+        // take the objects of the previous thread, once all have been read
+        pthread_barrier_wait(&larson_barrier);
+        void** prev_slots = contexts[(context.index + threads_count - 1)
+                                     % threads_count].slots;
+        pthread_barrier_wait(&larson_barrier);
+        context.slots = prev_slots;
+    }
+}
+
+// batches of 64 bytes objects allocated, then freed
+void runThreadtest(ThreadContext& context) {
+    const size_t batch_size = 1000;
+    void** batch = context.slots;
+
+    for (size_t i = 0; i < context.ops_count && !context.failed; ) {
+        size_t count = std::min(batch_size, context.ops_count - i);
+        for (size_t j = 0; j < count; j++) {
+            uint64_t start_ns = context.isTimedOp(i + j) ? getTimeNs() : 0;
+            batch[j] = benchMalloc(64);
+            if (start_ns != 0) {
+                context.recordLatency(start_ns);
+            }
+            if (batch[j] == NULL) {
+                context.failed = true;
+                count = j;
+                break;
+            }
+            *(char*)batch[j] = 1;
+        }
+        for (size_t j = 0; j < count; j++) {
+            benchFree(batch[j]);
+        }
+        i += batch_size;
+    }
+}
+
+/* cache-scratch: every thread frees a small object allocated by the main
+ * thread next to the objects of the other threads, then keeps allocating
+ * small objects and writing to them. Allocators that give threads memory
+ * on shared cache lines slow down from false sharing */
+void runCacheScratch(ThreadContext& context) {
+    const size_t writes_count = 100;
+
+    benchFree(context.slots[0]);
+    context.slots[0] = NULL;
+
+    for (size_t i = 0; i < context.ops_count && !context.failed; i++) {
+        uint64_t start_ns = context.isTimedOp(i) ? getTimeNs() : 0;
+        volatile char* object = (volatile char*)benchMalloc(8);
+        if (object == NULL) {
+            context.failed = true;
+            break;
+        }
+        for (size_t j = 0; j < writes_count; j++) {
+            object[j % 8]++;
+        }
+        benchFree((void*)object);
+        if (start_ns != 0) {
+            context.recordLatency(start_ns);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+class Workload {
+public:
+    const char* name;
+    void (*run)(ThreadContext& context);
+    size_t default_threads_count;
+    size_t slots_count;
+    // allocates so much over time that it can't run without free
+    bool needs_free;
+};
+
+const Workload WORKLOADS[] = {
+    {"fixed", runFixed, 1, 1000, false},
+    {"random", runRandom, 1, 1000, false},
+    {"realloc", runRealloc, 1, 0, true},
+    {"larson", runLarson, 4, 1000, false},
+    {"threadtest", runThreadtest, 4, 1000, false},
+    {"cache-scratch", runCacheScratch, 4, 1, false},
+};
+
+const Workload* current_workload;
+
+void* runWorkloadThread(void* arg) {
+    current_workload->run(*(ThreadContext*)arg);
+    return NULL;
+}
+
+uint64_t getPercentile(uint64_t* sorted_latencies, size_t count,
+        double percentile) {
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t index = (size_t)(percentile * (count - 1));
+    return sorted_latencies[index];
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <workload> [threads] [ops per thread]\n",
+                argv[0]);
+        return 1;
+    }
+
+    for (const Workload& workload : WORKLOADS) {
+        if (strcmp(workload.name, argv[1]) == 0) {
+            current_workload = &workload;
+        }
+    }
+    if (current_workload == NULL) {
+        fprintf(stderr, "unknown workload %s\n", argv[1]);
+        return 1;
+    }
+
+    // an empty threads argument takes the workload's default
+    threads_count = argc > 2 && argv[2][0] != '\0'
+                    ? strtoul(argv[2], NULL, 10)
+                    : current_workload->default_threads_count;
+    size_t ops_count = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+    if (threads_count == 0 || ops_count == 0) {
+        fprintf(stderr, "threads and ops must be positive\n");
+        return 1;
+    }
+
+    if (current_workload->needs_free && !ALLOCATOR_FREES) {
+        printf("{\"allocator\": \"%s\", \"workload\": \"%s\", "
+               "\"skipped\": \"the allocator never frees\"}\n",
+               ALLOCATOR_NAME, current_workload->name);
+        return 0;
+    }
+    use_allocator_mutex = threads_count > 1 && !ALLOCATOR_IS_THREAD_SAFE;
+
+    contexts = (ThreadContext*)mapMemory(threads_count * sizeof(ThreadContext));
+    for (size_t i = 0; i < threads_count; i++) {
+        ThreadContext& context = contexts[i];
+        context.index = i;
+        context.ops_count = ops_count;
+        context.random_state = 0x9e3779b97f4a7c15 * (i + 1);
+        context.latencies = (uint64_t*)mapMemory(
+                (ops_count / LATENCY_SAMPLE_PERIOD + 1) * sizeof(uint64_t));
+        context.slots_count = current_workload->slots_count;
+        context.slots = (void**)mapMemory(
+                (context.slots_count + 1) * sizeof(void*));
+    }
+
+    if (current_workload->run == runCacheScratch) {
+        // the objects of all the threads are allocated together
+        for (size_t i = 0; i < threads_count; i++) {
+            contexts[i].slots[0] = benchMalloc(8);
+        }
+    }
+    pthread_barrier_init(&larson_barrier, NULL, threads_count);
+
+    uint64_t start_ns = getTimeNs();
+    if (threads_count == 1) {
+        current_workload->run(contexts[0]);
+    } else {
+        for (size_t i = 0; i < threads_count; i++) {
+            pthread_create(&contexts[i].thread, NULL, runWorkloadThread,
+                           &contexts[i]);
+        }
+        for (size_t i = 0; i < threads_count; i++) {
+            pthread_join(contexts[i].thread, NULL);
+        }
+    }
+    uint64_t elapsed_ns = getTimeNs() - start_ns;
+
+    // all the latencies, sorted
+    size_t latencies_count = 0;
+    for (size_t i = 0; i < threads_count; i++) {
+        latencies_count += contexts[i].latencies_count;
+    }
+    uint64_t* latencies = (uint64_t*)mapMemory(
+            (latencies_count + 1) * sizeof(uint64_t));
+    size_t copied_count = 0;
+    bool failed = false;
+    for (size_t i = 0; i < threads_count; i++) {
+        memcpy(latencies + copied_count, contexts[i].latencies,
+               contexts[i].latencies_count * sizeof(uint64_t));
+        copied_count += contexts[i].latencies_count;
+        failed = failed || contexts[i].failed;
+    }
+    std::sort(latencies, latencies + latencies_count);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double total_ops_count = (double)ops_count * threads_count;
+    printf("{\"allocator\": \"%s\", \"workload\": \"%s\", \"threads\": %zu, "
+           "\"ops\": %.0f, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+           "\"peak_rss_kb\": %ld, \"failed\": %s}\n",
+           ALLOCATOR_NAME, current_workload->name, threads_count,
+           total_ops_count, elapsed_ns / 1e9,
+           total_ops_count / (elapsed_ns / 1e9),
+           (unsigned long long)getPercentile(latencies, latencies_count, 0.5),
+           (unsigned long long)getPercentile(latencies, latencies_count, 0.99),
+           (unsigned long long)getPercentile(latencies, latencies_count, 0.999),
+           usage.ru_maxrss, failed ? "true" : "false");
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,420 @@
+/* replays a trace of smalloc_trace_start() against an allocator. One binary
+ * is built per allocator like bench.cpp, see run.sh. Usage:
+ *
+ *     replay_<allocator> <trace file>
+ *
+ * The records of all the threads are replayed on one thread in timestamp
+ * order, touching a byte in every page of every block. Prints one JSON line
+ * with the replay time, the peak live bytes requested, the peak footprint
+ * (resident memory above what it was before replaying) and the
+ * fragmentation at the peak footprint: the share of the footprint that
+ * wasn't live bytes */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "allocator.h"
+
+// ----------------------------------------------------------------------------
+
+// the layout of SmallocTraceRecord of malloc_3.cpp, which may not be built in
+
+enum TraceOp {
+    TRACE_MALLOC = 0,
+    TRACE_CALLOC = 1,
+    TRACE_FREE = 2,
+    TRACE_REALLOC_BEGIN = 3,
+    TRACE_REALLOC = 4,
+    TRACE_ALIGNED_ALLOC = 5
+};
+
+struct TraceRecord {
+    uint64_t timestamp_ns;
+    uint64_t pointer;
+    uint64_t argument;
+    uint64_t size;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved[5];
+};
+
+const char TRACE_MAGIC[8] = "smtrac2";
+
+const size_t TRACE_THREADS_COUNT = 64 * 1024;
+
+// RSS is sampled every this many records
+const size_t FOOTPRINT_SAMPLE_PERIOD = 1024;
+
+// ----------------------------------------------------------------------------
+
+// the blocks live in the replay, by the pointer they had in the trace
+class LiveBlock {
+public:
+    // 0 if the entry is unused
+    uint64_t trace_pointer;
+    void* p;
+    size_t size;
+};
+
+class LiveBlocksTable {
+public:
+    LiveBlock* blocks;
+    // a power of 2, at least twice the number of allocations in the trace
+    size_t capacity;
+
+    explicit LiveBlocksTable(size_t max_blocks_count);
+
+    static size_t getHash(uint64_t trace_pointer);
+
+    // NULL if not found
+    LiveBlock* find(uint64_t trace_pointer);
+
+    void insert(uint64_t trace_pointer, void* p, size_t size);
+
+    void remove(LiveBlock* block);
+};
+
+LiveBlocksTable::LiveBlocksTable(size_t max_blocks_count) : capacity(16) {
+    while (capacity < 2 * max_blocks_count) {
+        capacity *= 2;
+    }
+    blocks = (LiveBlock*)mapMemory(capacity * sizeof(LiveBlock));
+    // faulted in now, so it doesn't count in the footprint
+    memset(blocks, 0, capacity * sizeof(LiveBlock));
+}
+
+size_t LiveBlocksTable::getHash(uint64_t trace_pointer) {
+    return (trace_pointer >> 4) * 0x9e3779b97f4a7c15;
+}
+
+LiveBlock* LiveBlocksTable::find(uint64_t trace_pointer) {
+    size_t mask = capacity - 1;
+    for (size_t i = getHash(trace_pointer) & mask; blocks[i].trace_pointer != 0;
+         i = (i + 1) & mask) {
+        if (blocks[i].trace_pointer == trace_pointer) {
+            return &blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+void LiveBlocksTable::insert(uint64_t trace_pointer, void *p, size_t size) {
+    // overwrites the entry of a block the trace didn't free
+    LiveBlock* block = find(trace_pointer);
+    if (block == NULL) {
+        size_t mask = capacity - 1;
+        size_t i = getHash(trace_pointer) & mask;
+        while (blocks[i].trace_pointer != 0) {
+            i = (i + 1) & mask;
+        }
+        block = &blocks[i];
+    }
+
+    block->trace_pointer = trace_pointer;
+    block->p = p;
+    block->size = size;
+}
+
+void LiveBlocksTable::remove(LiveBlock *block) {
+    // backward shift deletion, so lookups need no tombstones
+    size_t mask = capacity - 1;
+    size_t index = block - blocks;
+    size_t next_index = index;
+    while (true) {
+        blocks[index].trace_pointer = 0;
+        while (true) {
+            next_index = (next_index + 1) & mask;
+            if (blocks[next_index].trace_pointer == 0) {
+                return;
+            }
+            size_t home_index = getHash(blocks[next_index].trace_pointer) & mask;
+            // the entry can move back only if index is between home and it
+            if (((next_index - home_index) & mask)
+                >= ((next_index - index) & mask)) {
+                break;
+            }
+        }
+        blocks[index] = blocks[next_index];
+        index = next_index;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// resident bytes of the process, from /proc/self/statm. 0 on failure
+size_t getResidentBytes() {
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    char buffer[128];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+
+    // the second field is the resident pages
+    char* field = strchr(buffer, ' ');
+    if (field == NULL) {
+        return 0;
+    }
+
+    return strtoul(field + 1, NULL, 10) * getpagesize();
+}
+
+// so the blocks are resident, like the memory of the traced program was
+void touchPages(void* p, size_t size) {
+    size_t page_size = getpagesize();
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        ((volatile char*)p)[offset] = 1;
+    }
+    ((volatile char*)p)[size - 1] = 1;
+}
+
+class Replay {
+public:
+    LiveBlocksTable live_blocks;
+    /* by thread, the block between its SMALLOC_TRACE_REALLOC_BEGIN and
+     * SMALLOC_TRACE_REALLOC records. It isn't in live_blocks meanwhile */
+    LiveBlock* reallocated_blocks;
+    size_t live_bytes;
+    size_t peak_live_bytes;
+    size_t base_resident_bytes;
+    size_t peak_footprint_bytes;
+    size_t live_bytes_at_peak_footprint;
+    // allocations that failed here but not in the trace
+    size_t failed_count;
+    // frees and reallocations of blocks allocated before tracing started
+    size_t unknown_blocks_count;
+
+    explicit Replay(size_t max_blocks_count);
+
+    void replayRecord(const TraceRecord& record);
+
+    // touches the pages of a new block
+    void addBlock(uint64_t trace_pointer, void* p, size_t size);
+
+    void restoreBlock(const LiveBlock& block);
+
+    void beginRealloc(const TraceRecord& record);
+
+    void endRealloc(const TraceRecord& record);
+
+    void removeBlock(LiveBlock* block);
+
+    void sampleFootprint();
+};
+
+Replay::Replay(size_t max_blocks_count)
+        : live_blocks(max_blocks_count), live_bytes(0), peak_live_bytes(0),
+          peak_footprint_bytes(0), live_bytes_at_peak_footprint(0),
+          failed_count(0), unknown_blocks_count(0)
+{
+    size_t reallocated_blocks_size = TRACE_THREADS_COUNT * sizeof(LiveBlock);
+    reallocated_blocks = (LiveBlock*)mapMemory(reallocated_blocks_size);
+    memset(reallocated_blocks, 0, reallocated_blocks_size);
+
+    base_resident_bytes = getResidentBytes();
+}
+
+void Replay::replayRecord(const TraceRecord &record) {
+    switch (record.op) {
+        case TRACE_MALLOC:
+            addBlock(record.pointer, benchMalloc(record.size), record.size);
+            break;
+        case TRACE_CALLOC:
+            addBlock(record.pointer, benchCalloc(record.size), record.size);
+            break;
+        case TRACE_ALIGNED_ALLOC:
+            addBlock(record.pointer,
+                     benchAlignedAlloc(record.argument, record.size),
+                     record.size);
+            break;
+        case TRACE_FREE: {
+            LiveBlock* block = live_blocks.find(record.pointer);
+            if (block == NULL) {
+                unknown_blocks_count++;
+                break;
+            }
+            benchFree(block->p);
+            removeBlock(block);
+            break;
+        }
+        case TRACE_REALLOC_BEGIN:
+            beginRealloc(record);
+            break;
+        case TRACE_REALLOC:
+            endRealloc(record);
+            break;
+        default:
+            break;
+    }
+}
+
+void Replay::addBlock(uint64_t trace_pointer, void *p, size_t size) {
+    if (p == NULL) {
+        failed_count++;
+        return;
+    }
+
+    LiveBlock* block = live_blocks.find(trace_pointer);
+    if (block != NULL) {
+        // the trace lost the free of the block, its memory stays used
+        live_bytes -= block->size;
+    }
+
+    touchPages(p, size);
+    live_blocks.insert(trace_pointer, p, size);
+    live_bytes += size;
+    peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+}
+
+void Replay::restoreBlock(const LiveBlock &block) {
+    live_blocks.insert(block.trace_pointer, block.p, block.size);
+    live_bytes += block.size;
+}
+
+void Replay::beginRealloc(const TraceRecord &record) {
+    LiveBlock* block = live_blocks.find(record.pointer);
+    if (block == NULL) {
+        unknown_blocks_count++;
+        return;
+    }
+
+    reallocated_blocks[record.thread] = *block;
+    removeBlock(block);
+}
+
+void Replay::endRealloc(const TraceRecord &record) {
+    LiveBlock block = reallocated_blocks[record.thread];
+    memset(&reallocated_blocks[record.thread], 0, sizeof(LiveBlock));
+    if (record.argument == 0 || block.trace_pointer != record.argument) {
+        // the block was NULL, or allocated before tracing started
+        memset(&block, 0, sizeof(LiveBlock));
+    }
+
+    if (record.size == 0) {
+        // reallocating failed in the trace
+        if (block.p != NULL) {
+            restoreBlock(block);
+        }
+        return;
+    }
+
+    void* p = benchRealloc(block.p, block.size, record.size);
+    if (p == NULL) {
+        if (block.p != NULL) {
+            restoreBlock(block);
+        }
+        failed_count++;
+        return;
+    }
+    addBlock(record.pointer, p, record.size);
+}
+
+void Replay::removeBlock(LiveBlock *block) {
+    live_bytes -= block->size;
+    live_blocks.remove(block);
+}
+
+void Replay::sampleFootprint() {
+    size_t resident_bytes = getResidentBytes();
+    size_t footprint_bytes = resident_bytes > base_resident_bytes
+                             ? resident_bytes - base_resident_bytes : 0;
+    if (footprint_bytes > peak_footprint_bytes) {
+        peak_footprint_bytes = footprint_bytes;
+        live_bytes_at_peak_footprint = live_bytes;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+const TraceRecord* records;
+
+// by timestamp, the records of a thread keep their order
+bool isRecordBefore(uint32_t first_index, uint32_t second_index) {
+    if (records[first_index].timestamp_ns != records[second_index].timestamp_ns) {
+        return records[first_index].timestamp_ns
+               < records[second_index].timestamp_ns;
+    }
+
+    return first_index < second_index;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat trace_stat;
+    if (fd < 0 || fstat(fd, &trace_stat) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    size_t trace_size = trace_stat.st_size;
+    const char* trace = trace_size == 0 ? NULL : (const char*)mmap(NULL,
+            trace_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace == NULL || trace == MAP_FAILED || trace_size < sizeof(TRACE_MAGIC)
+        || memcmp(trace, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || (trace_size - sizeof(TRACE_MAGIC)) % sizeof(TraceRecord) != 0) {
+        fprintf(stderr, "%s isn't a trace\n", argv[1]);
+        return 1;
+    }
+    close(fd);
+
+    records = (const TraceRecord*)(trace + sizeof(TRACE_MAGIC));
+    size_t records_count = (trace_size - sizeof(TRACE_MAGIC))
+                           / sizeof(TraceRecord);
+    uint32_t* order = (uint32_t*)mapMemory(
+            (records_count + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < records_count; i++) {
+        order[i] = (uint32_t)i;
+    }
+    std::sort(order, order + records_count, isRecordBefore);
+
+    Replay replay(records_count);
+
+    uint64_t start_ns = getTimeNs();
+    for (size_t i = 0; i < records_count; i++) {
+        replay.replayRecord(records[order[i]]);
+        if (i % FOOTPRINT_SAMPLE_PERIOD == 0) {
+            replay.sampleFootprint();
+        }
+    }
+    uint64_t elapsed_ns = getTimeNs() - start_ns;
+    replay.sampleFootprint();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double fragmentation = 0;
+    if (replay.peak_footprint_bytes > replay.live_bytes_at_peak_footprint) {
+        fragmentation = 1 - (double)replay.live_bytes_at_peak_footprint
+                            / replay.peak_footprint_bytes;
+    }
+
+    printf("{\"allocator\": \"%s\", \"trace\": \"%s\", \"records\": %zu, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+           "\"peak_live_bytes\": %zu, \"peak_footprint_bytes\": %zu, "
+           "\"fragmentation\": %.4f, \"peak_rss_kb\": %ld, "
+           "\"failed\": %zu, \"unknown_blocks\": %zu}\n",
+           ALLOCATOR_NAME, argv[1], records_count, elapsed_ns / 1e9,
+           records_count / (elapsed_ns / 1e9), replay.peak_live_bytes,
+           replay.peak_footprint_bytes, fragmentation, usage.ru_maxrss,
+           replay.failed_count, replay.unknown_blocks_count);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# builds the benchmark for every allocator and runs every workload, printing
+# one JSON line per run. Usage: bench/run.sh [ops per thread] > results.jsonl
+# With TRACE set to a trace of smalloc_trace_start(), replays it instead.
+# CXXFLAGS are added to the builds, e.g. -DSMALLOC_FIT_POLICY=BestFitPolicy
+set -e
+
+cd "$(dirname "$0")"
+OPS=${1:-1000000}
+# malloc_1 never frees, so it runs fewer operations to fit in memory
+MALLOC_1_OPS=$((OPS / 10))
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-}
+
+mkdir -p build
+for allocator in malloc_1 malloc_2 malloc_3 system; do
+    macro=BENCH_$(echo "$allocator" | tr a-z A-Z)
+    "$CXX" -std=c++11 -O2 -pthread $CXXFLAGS -D"$macro" bench.cpp \
+        -o build/bench_"$allocator"
+    "$CXX" -std=c++11 -O2 -pthread $CXXFLAGS -D"$macro" replay.cpp \
+        -o build/replay_"$allocator"
+done
+
+if [ -n "$TRACE" ]; then
+    for allocator in malloc_1 malloc_2 malloc_3 system; do
+        build/replay_"$allocator" "$TRACE"
+    done
+    exit 0
+fi
+
+for allocator in malloc_1 malloc_2 malloc_3 system; do
+    ops=$OPS
+    if [ "$allocator" = malloc_1 ]; then
+        ops=$MALLOC_1_OPS
+    fi
+    for workload in fixed random realloc larson threadtest cache-scratch; do
+        # each run is its own process, so that the peak RSS is its own
+        build/bench_"$allocator" "$workload" "" "$ops" \
+            || echo "{\"allocator\": \"$allocator\", \"workload\": \"$workload\", \"failed\": true}"
+    done
+done
@@ -1,6 +1,49 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mremap()
+#endif
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <execinfo.h>
+#include <math.h>
+#include <sched.h>
+#include <atomic>
+#ifdef SMALLOC_DEBUG
+#include <stdlib.h> // for abort()
+#endif
+
+/* the largest allocation in bytes, larger requests fail. malloc_preload.cpp
+ * raises it to what libc allows */
+#ifndef SMALLOC_MAX_SIZE
+#define SMALLOC_MAX_SIZE 1e8
+#endif
+
+/* compile time tuning, to benchmark alternatives without runtime cost.
+ * SMALLOC_FIT_POLICY picks the free heap block an allocation gets, one of
+ * LifoFitPolicy, FirstFitPolicy, NextFitPolicy, BestFitPolicy and
+ * GoodFitPolicy */
+#ifndef SMALLOC_FIT_POLICY
+#define SMALLOC_FIT_POLICY LifoFitPolicy
+#endif
+// least payload of the free block split off a larger one
+#ifndef SMALLOC_SPLITTING_THRESHOLD
+#define SMALLOC_SPLITTING_THRESHOLD 128
+#endif
+// allocations of at least this many bytes are mmapped
+#ifndef SMALLOC_MMAP_THRESHOLD
+#define SMALLOC_MMAP_THRESHOLD (128 * 1024)
+#endif
+/* 0 serves the smallest objects from the heap instead of slabs, so every
+ * block has metadata, like for the tests of the _num_* functions */
+#ifndef SMALLOC_SLABS
+#define SMALLOC_SLABS 1
+#endif
 
 // malloc family of functions prototypes
 
@@ -10,12 +53,271 @@ void* scalloc(size_t num, size_t size);
 
 void sfree(void* p);
 
+/* like sfree(). @size is the size @p was allocated or last reallocated with,
+ * it spares looking up which allocator @p came from. With SMALLOC_DEBUG
+ * defined, a @size larger than the block aborts */
+void ssized_free(void* p, size_t size);
+
+/* allocate @n blocks of @size bytes into @ptrs, cut from one block of the
+ * heap when their size allows. Return the number of blocks allocated, which
+ * is less than @n only when out of memory */
+size_t smalloc_batch(size_t size, size_t n, void** ptrs);
+
+/* sfree() the @n pointers of @ptrs. Adjacent heap blocks are merged before
+ * they are freed, so they are combined with their neighbours once. @ptrs is
+ * reordered and overwritten */
+void sfree_batch(void** ptrs, size_t n);
+
 void* srealloc(void* oldp, size_t size);
 
+/* the number of bytes the block @p can hold, at least the size it was
+ * allocated with. All of them may be used, and srealloc() growing the block
+ * up to them doesn't move it. 0 if @p is NULL */
+size_t susable_size(void* p);
+
+/* every block is aligned to at least 16 bytes. These return blocks aligned
+ * to @alignment, a power of 2, like their libc counterparts */
+
+void* saligned_alloc(size_t alignment, size_t size);
+
+int sposix_memalign(void** memptr, size_t alignment, size_t size);
+
+void* smemalign(size_t alignment, size_t size);
+
+// ----------------------------------------------------------------------------
+
+// tuning of the allocator, like mallopt()
+
+typedef enum {
+    /* max number of arenas threads are spread over. Affects only threads
+     * that didn't allocate yet */
+    M_ARENA_MAX = 1,
+    /* free memory at the end of a heap is given back to the OS once it is
+     * larger than this many bytes plus the size of the next growth chunk.
+     * Default: 128 KB */
+    M_TRIM_THRESHOLD = 2,
+    /* max bytes of released mmapped blocks kept for reuse, 0 disables the
+     * cache. Default: 32 MB */
+    M_MMAP_CACHE_MAX = 3,
+    /* heaps grow by chunks, starting at M_HEAP_GROWTH_MIN bytes and doubling
+     * up to M_HEAP_GROWTH_MAX bytes. Defaults: 128 KB and 2 MB */
+    M_HEAP_GROWTH_MIN = 4,
+    M_HEAP_GROWTH_MAX = 5,
+    /* huge pages for mmapped blocks of at least 2 MB, one of HugePagesMode.
+     * Default: HUGE_PAGES_NONE */
+    M_HUGE_PAGES = 6,
+    /* 1 to grow heaps by 2 MB aligned chunks advised for transparent huge
+     * pages, 0 otherwise. Default: 0 */
+    M_HEAP_HUGE_PAGES = 7,
+    /* sample about one allocation per this many bytes for the heap profile
+     * of smalloc_profile_print(), 0 stops sampling. Default: 0 */
+    M_PROFILE_SAMPLE_RATE = 8,
+    /* allocations of at least this many bytes are mmapped. The threshold
+     * rises by itself to the size of mmapped blocks freed soon after they
+     * were allocated, up to M_MMAP_THRESHOLD_MAX, so buffers that are
+     * allocated and freed over and over stay on the heap. Setting
+     * M_MMAP_THRESHOLD fixes it, setting M_TRIM_THRESHOLD stops it from
+     * raising the trim threshold along. Default: 128 KB */
+    M_MMAP_THRESHOLD = 9,
+    /* the bounds of the rising threshold. Setting M_MMAP_THRESHOLD_MIN
+     * restarts it from there. Defaults: 128 KB and 32 MB */
+    M_MMAP_THRESHOLD_MIN = 10,
+    M_MMAP_THRESHOLD_MAX = 11
+} SmalloptParam;
+
+typedef enum {
+    HUGE_PAGES_NONE = 0,
+    // 2 MB aligned mappings advised with MADV_HUGEPAGE
+    HUGE_PAGES_TRANSPARENT = 1,
+    /* MAP_HUGETLB mappings, falling back to HUGE_PAGES_TRANSPARENT when there
+     * are no free hugetlbfs pages */
+    HUGE_PAGES_HUGETLB = 2
+} HugePagesMode;
+
+/* set @param to @value. Return 1 on success, or 0 if the param is unknown or
+ * the value is out of range */
+int smallopt(int param, int value);
+
+/* give back to the OS the free memory at the end of every heap, keeping @pad
+ * bytes of it, the whole pages inside other free blocks and the cached
+ * mmapped blocks. Return 1 if any memory was released, 0 otherwise */
+int smalloc_trim(size_t pad);
+
+/* grow the heap of the calling thread so @bytes bytes can be allocated
+ * without system calls, and keep them when trimming. Return 1 on success,
+ * 0 otherwise */
+int sreserve(size_t bytes);
+
+// ----------------------------------------------------------------------------
+
+// statistics of the allocator
+
+/* size class i of the histograms holds the blocks with a payload of more
+ * than 8 << i bytes and at most 16 << i bytes. The first one starts from 1
+ * byte and the last one has no upper bound */
+const size_t SMALLOC_STATS_SIZE_CLASSES_COUNT = 24;
+
+// blocks of one tier and their payload bytes
+typedef struct {
+    size_t used_blocks;
+    size_t free_blocks;
+    size_t used_bytes;
+    size_t free_bytes;
+} SmallocTierStats;
+
+typedef struct {
+    /* blocks in thread caches count as used. Free mmapped blocks are the
+     * cached mappings, free slab blocks the unused slots */
+    SmallocTierStats heap;
+    SmallocTierStats mmapped;
+    SmallocTierStats slab;
+    // payload of the largest free heap block
+    size_t largest_free_block;
+    // space after the last heap blocks, taken from the OS but not used yet
+    size_t heap_top_bytes;
+
+    size_t used_blocks_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+    size_t free_blocks_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+
+    // heap blocks split in two, and free heap blocks combined into one
+    size_t splits_count;
+    size_t coalesces_count;
+
+    // system calls made so far, sbrk() counted only when it moves the break
+    size_t sbrk_calls_count;
+    size_t mmap_calls_count;
+    size_t munmap_calls_count;
+    size_t mremap_calls_count;
+    size_t mprotect_calls_count;
+    size_t madvise_calls_count;
+
+    // max resident set size of the process
+    size_t peak_rss_bytes;
+} SmallocStats;
+
+// takes the lock of every arena, so it isn't meant for hot paths
+SmallocStats smalloc_stats();
+
+typedef enum {
+    SMALLOC_STATS_TEXT = 0,
+    SMALLOC_STATS_JSON = 1
+} SmallocStatsFormat;
+
+/* write smalloc_stats() to @fd in @format. Doesn't allocate. Return 1 on
+ * success, 0 otherwise */
+int smalloc_stats_print(int fd, SmallocStatsFormat format);
+
+// fragmentation of the free heap blocks of all arenas, the top chunks aside
+typedef struct {
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free_block;
+    /* 1 - largest_free_block / free_bytes. 0 when the free memory is one
+     * block, close to 1 when it is scattered over many small blocks */
+    double external_fragmentation;
+    /* free blocks with less payload than SMALLOC_SPLITTING_THRESHOLD, 128
+     * bytes, the least a block is split to. Only allocations that small can
+     * use them */
+    size_t small_free_blocks;
+    // by the size classes of SmallocStats
+    size_t free_blocks_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+    size_t free_bytes_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+} SmallocFragmentation;
+
+/* kept up to date as blocks are freed and allocated, so this doesn't walk
+ * the heaps and can be called periodically */
+SmallocFragmentation smalloc_fragmentation();
+
+/* write a map of the heap of every arena to @fd: a line per heap with its
+ * start address, then its runs of adjacent used and free blocks as
+ * "U<blocks>:<bytes>" and "F<blocks>:<bytes>", then the top chunk as
+ * "T:<bytes>". Sizes include metadata. Walks all the blocks of an arena
+ * under its lock. Doesn't allocate. Return 1 on success, 0 otherwise */
+int smalloc_heap_map_print(int fd);
+
+typedef enum {
+    // sampled allocations that weren't freed yet
+    SMALLOC_PROFILE_LIVE = 0,
+    // all the sampled allocations since sampling was turned on
+    SMALLOC_PROFILE_ALLOCATED = 1
+} SmallocProfileType;
+
+/* write the heap profile of M_PROFILE_SAMPLE_RATE to @fd as collapsed stacks:
+ * a line per call stack with its return addresses in hex, outermost first
+ * and separated by ';', then a space and the estimated bytes. Doesn't
+ * allocate. Return 1 on success, 0 otherwise */
+int smalloc_profile_print(int fd, SmallocProfileType type);
+
+// ----------------------------------------------------------------------------
+
+// allocation tracing, for replaying real workloads. See bench/replay.cpp
+
+typedef enum {
+    SMALLOC_TRACE_MALLOC = 0,
+    SMALLOC_TRACE_CALLOC = 1,
+    SMALLOC_TRACE_FREE = 2,
+    /* srealloc() of a block is traced before and after reallocating, as
+     * other threads may reuse its old address or have freed its new one
+     * meanwhile. The two records have the same thread */
+    SMALLOC_TRACE_REALLOC_BEGIN = 3,
+    SMALLOC_TRACE_REALLOC = 4,
+    // saligned_alloc(), sposix_memalign() and smemalign()
+    SMALLOC_TRACE_ALIGNED_ALLOC = 5
+} SmallocTraceOp;
+
+/* a trace is SMALLOC_TRACE_MAGIC followed by records. The records of a thread
+ * are in order, but the threads' records are interleaved in chunks, so they
+ * are ordered by timestamp_ns. smalloc_batch() and sfree_batch() are traced
+ * as one record per block, ssized_free() as SMALLOC_TRACE_FREE */
+typedef struct {
+    // CLOCK_MONOTONIC. Taken after allocating and before freeing
+    uint64_t timestamp_ns;
+    /* the address allocated, or freed for SMALLOC_TRACE_FREE and
+     * SMALLOC_TRACE_REALLOC_BEGIN. Addresses identify blocks: an address is
+     * reused only once its block was freed */
+    uint64_t pointer;
+    /* the address reallocated for SMALLOC_TRACE_REALLOC, the alignment for
+     * SMALLOC_TRACE_ALIGNED_ALLOC, 0 otherwise */
+    uint64_t argument;
+    /* bytes requested. 0 for SMALLOC_TRACE_FREE, and for SMALLOC_TRACE_REALLOC
+     * when reallocating failed and the block stayed at pointer */
+    uint64_t size;
+    // numbered from 1 by first traced call
+    uint16_t thread;
+    // a SmallocTraceOp
+    uint8_t op;
+    uint8_t reserved[5];
+} SmallocTraceRecord;
+
+// the last character numbers the record layout
+const char SMALLOC_TRACE_MAGIC[8] = "smtrac2";
+
+/* start appending a record of every successful allocation and free to @fd,
+ * a regular file. The records are buffered per thread, and written a buffer
+ * per write(). Return 1 on success, 0 if tracing already or writing failed */
+int smalloc_trace_start(int fd);
+
+/* write the buffered records and stop tracing. Return 1 on success, 0 if
+ * not tracing or any write failed */
+int smalloc_trace_stop();
+
 // ----------------------------------------------------------------------------
 
 // private functions for testing
 
+/* the counters cover every tier. Objects of up to SLAB_MAX_PAYLOAD_SIZE
+ * bytes live in slab slots, which count as allocated blocks of their slot
+ * size while used. A released slot goes back to its slab and leaves the
+ * counts, like memory given back to the top chunk, so it never counts as
+ * free. Build with SMALLOC_SLABS defined to 0 to have them on the heap,
+ * where they count like the other heap blocks, freed ones as free blocks.
+ *
+ * They first flush the thread cache of the caller, so its freed blocks count
+ * as free. A cache refill takes blocks ahead of time only from free blocks,
+ * which the flushed ones merge back into, so the caller's counts are those
+ * without the cache, except that a payload is rounded up to the bin width
+ * of the cache. Blocks in the caches of other threads count as allocated */
+
 size_t _num_free_blocks();
 
 size_t _num_free_bytes();
@@ -28,12 +330,51 @@ size_t _num_meta_data_bytes();
 
 size_t _size_meta_data();
 
+// bytes backed by huge pages, of hugetlbfs or transparent ones
+size_t _num_huge_page_bytes();
+
 // ----------------------------------------------------------------------------
 
 size_t min(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
+size_t max(size_t a, size_t b) {
+    return a > b ? a : b;
+}
+
+// here the subtrees of @root's children are heaps within addrs[0, end)
+void siftDownAddress(void** addrs, size_t root, size_t end) {
+    for (size_t child = 2 * root + 1; child < end; child = 2 * root + 1) {
+        if (child + 1 < end && addrs[child + 1] > addrs[child]) {
+            child++;
+        }
+        if (addrs[root] >= addrs[child]) {
+            return;
+        }
+
+        void* root_addr = addrs[root];
+        addrs[root] = addrs[child];
+        addrs[child] = root_addr;
+        root = child;
+    }
+}
+
+// heapsort, as qsort() may allocate
+void sortAddresses(void** addrs, size_t count) {
+    for (size_t root = count / 2; root > 0; root--) {
+        siftDownAddress(addrs, root - 1, count);
+    }
+
+    for (size_t end = count; end > 1; end--) {
+        // move the max to the end of the unsorted part
+        void* max_addr = addrs[0];
+        addrs[0] = addrs[end - 1];
+        addrs[end - 1] = max_addr;
+        siftDownAddress(addrs, 0, end - 1);
+    }
+}
+
 const int KB = 1024;
 
 typedef enum {
@@ -42,1020 +383,5151 @@ typedef enum {
 } BytesType;
 
 typedef enum {
-    TOTAL_PAYLOAD = 0,
-    ACTIVE_PAYLOAD = 1
-} SizeType;
-
-class MallocMetadata {
+    SBRK_CALL = 0,
+    MMAP_CALL = 1,
+    MUNMAP_CALL = 2,
+    MREMAP_CALL = 3,
+    MPROTECT_CALL = 4,
+    MADVISE_CALL = 5,
+    SYSTEM_CALLS_COUNT = 6
+} SystemCall;
+
+// number of system calls made, for smalloc_stats()
+class SystemCallsCounters {
 public:
-    size_t size[2];
-    bool is_free;
-    MallocMetadata *next, *prev; // no use for mmap blocks
+    std::atomic<size_t> calls_counts[SYSTEM_CALLS_COUNT];
 
-    MallocMetadata() = default;
+    void count(SystemCall call);
 
-    void* getPayloadBlockAddr();
+    size_t getCallsCount(SystemCall call);
 };
 
-void *MallocMetadata::getPayloadBlockAddr() {
-    return (void*)(this + 1);
+void SystemCallsCounters::count(SystemCall call) {
+    calls_counts[call].fetch_add(1, std::memory_order_relaxed);
 }
 
-class HeapBlocksList {
-public:
-    const size_t SPLITTING_THRESHOLD = 128;
+size_t SystemCallsCounters::getCallsCount(SystemCall call) {
+    return calls_counts[call].load(std::memory_order_relaxed);
+}
 
-    MallocMetadata *head, *tail;
-    size_t blocks_count[2];
-    size_t bytes_count[2];
+// zero initialized before any constructor runs
+SystemCallsCounters system_calls_counters;
 
-    HeapBlocksList();
+size_t getStatsSizeClass(size_t payload_size) {
+    if (payload_size <= 16) {
+        return 0;
+    }
 
-    void* allocateBlock(size_t payload_size);
+    // class i holds payloads in (2^(i+3), 2^(i+4)]
+    size_t log2_size_ceil = 64 - __builtin_clzl(payload_size - 1);
+    return min(log2_size_ceil - 4, SMALLOC_STATS_SIZE_CLASSES_COUNT - 1);
+}
 
-    void* allocateZeroedBlock(size_t payload_size);
+typedef enum {
+    FREE_FLAG = 1,
+    MMAPPED_FLAG = 2,
+    // the previous block in the heap is free, so its boundary tag is valid
+    PREV_FREE_FLAG = 4,
+    // an mmapped block backed by hugetlbfs pages
+    HUGETLB_FLAG = 8,
+    /* a heap block in a thread cache or a remote freed blocks queue. Heap
+     * blocks are never backed by hugetlbfs pages, so it shares their bit */
+    CACHED_FLAG = 8
+} BlockFlag;
+
+// block sizes are multiples of this, which leaves room for the flags
+const size_t BLOCK_SIZE_ALIGNMENT = 16;
+const size_t BLOCK_FLAGS_MASK = BLOCK_SIZE_ALIGNMENT - 1;
+
+/* compact block metadata: one word holding the size of the whole block
+ * (metadata and payload) with the flags in its low bits. Neighbours are
+ * found by address arithmetic. A free heap block keeps its bin links at the
+ * start of its payload, and a copy of its size (boundary tag) in its last
+ * word, so the next block can reach it.
+ * The word is written under the lock of the owning arena, except for the
+ * CACHED_FLAG of a used block, which its owner sets and clears without it
+ * while the PREV_FREE_FLAG may change. So flags are changed with relaxed
+ * atomic read-modify-writes, and the size with relaxed atomics (plain moves) */
+class MallocMetadata {
+public:
+    size_t size_and_flags;
 
-    MallocMetadata* findFreeBlock(size_t payload_size);
+    MallocMetadata() = default;
 
-    void* createNewBlock(size_t payload_size);
+    size_t getBlockSize();
 
-    void* useFreeBlock(MallocMetadata* free_block_metadata,
-            size_t new_active_payload_size);
+    size_t getPayloadSize();
 
-    void useFreeBlockWithoutSplit(MallocMetadata* original_block_metadata,
-            size_t new_active_payload_size);
+    void setBlockSize(size_t block_size);
 
-    void useFreeBlockWithSplit(MallocMetadata* original_block_metadata,
-            size_t new_active_payload_size, size_t remaining_payload_size);
+    bool hasFlag(BlockFlag flag);
 
-    void updateMetaDataAfterFreeBlockSplit(MallocMetadata* original_block_metadata,
-            MallocMetadata* remaining_block_metadata,
-            size_t new_active_payload_size,
-            size_t remaining_payload_size);
+    void setFlag(BlockFlag flag);
 
-    void* useWildernessBlock(size_t payload_size);
+    void clearFlag(BlockFlag flag);
 
-    void setNewBlockMetaData(size_t payload_size,
-            MallocMetadata* block_metadata);
+    void* getPayloadBlockAddr();
 
-    void releaseUsedBlock(void* payload_addr);
+    static MallocMetadata* getBlockMetadata(void* payload_addr);
 
-    void combineFreeBlockWithSucc(MallocMetadata* block_metadata);
+    // offset of the payload from the start of the mapping of an mmapped block
+    size_t getMMappedPrefixSize();
 
-    void combineFreeBlockWithPred(MallocMetadata* block_metadata);
+    void setMMappedPrefixSize(size_t prefix_size);
 
-    void combineFreeBlockWithSuccAndPred(MallocMetadata* block_metadata);
+    // when an mmapped block was last handed out, by getMonotonicTimeMs()
+    uint64_t getMMappedAllocationTimeMs();
 
-    void freeBlockWithoutCombining(MallocMetadata* block_metadata);
+    void setMMappedAllocationTimeMs(uint64_t time_ms);
 
-    void* reallocateActiveBlock(void* old_payload_addr, size_t new_payload_size);
+    // block that follows in memory. No bounds check
+    MallocMetadata* getNextBlock();
 
-    void* reallocateWithSameBlock(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+    // valid only if PREV_FREE_FLAG is on
+    MallocMetadata* getPrevBlock();
 
-    void splitUsedBlock(MallocMetadata* old_block_metadata,
-            size_t new_payload_size, size_t remaining_payload_size);
+    // write the boundary tag of a free block
+    void writeFooter();
 
-    void* reallocateWildernessBlock(size_t new_payload_size);
+    // bin links of free blocks, also used to chain cached blocks
+    MallocMetadata*& nextFree();
 
-    bool canReallocateUsingPredOrSucc(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+    MallocMetadata*& prevFree();
 
-    bool canReallocateUsingPredOnly(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+    // CACHED_FLAG of a heap block
+    bool isCached();
 
-    bool canReallocateUsingSuccOnly(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+    void setCached(bool is_cached);
+};
 
-    bool canReallocateUsingPredAndSucc(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+/* mmapped blocks keep their metadata three words after the start of the
+ * mapping, so their payload has the same alignment as heap payloads. Their
+ * block size is the length of the mapping. The word before the metadata
+ * holds the offset of the payload in the mapping, which is larger than
+ * MMAPPED_BLOCK_PREFIX_SIZE for aligned blocks, and the word before it the
+ * allocation time */
+const size_t MMAPPED_BLOCK_PREFIX_SIZE = 4 * sizeof(size_t);
 
-    void* reallocateUsingPredOrSucc(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+// free heap blocks must have room for the bin links and the boundary tag
+const size_t MIN_BLOCK_SIZE = 4 * sizeof(size_t);
 
-    void* reallocateUsingPredOnly(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+size_t MallocMetadata::getBlockSize() {
+    return __atomic_load_n(&size_and_flags, __ATOMIC_RELAXED) & ~BLOCK_FLAGS_MASK;
+}
 
-    void* reallocateUsingSuccOnly(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+size_t MallocMetadata::getPayloadSize() {
+    if (hasFlag(MMAPPED_FLAG)) {
+        return getBlockSize() - getMMappedPrefixSize();
+    }
+    return getBlockSize() - sizeof(MallocMetadata);
+}
 
-    void* reallocateUsingPredAndSucc(MallocMetadata* old_block_metadata,
-            size_t new_payload_size);
+void MallocMetadata::setBlockSize(size_t block_size) {
+    size_t flags = __atomic_load_n(&size_and_flags, __ATOMIC_RELAXED)
+                   & BLOCK_FLAGS_MASK;
+    __atomic_store_n(&size_and_flags, block_size | flags, __ATOMIC_RELAXED);
+}
 
-    void* reallocateToOtherBlock(MallocMetadata* old_block_metadata,
-            void * old_payload_addr, size_t new_payload_size);
-};
+bool MallocMetadata::hasFlag(BlockFlag flag) {
+    return (__atomic_load_n(&size_and_flags, __ATOMIC_RELAXED) & flag) != 0;
+}
 
-// ----------------------------------------------------------------------------
+void MallocMetadata::setFlag(BlockFlag flag) {
+    __atomic_fetch_or(&size_and_flags, (size_t)flag, __ATOMIC_RELAXED);
+}
 
-HeapBlocksList::HeapBlocksList()
-        : head(NULL), tail(NULL)
-{
-    blocks_count[FREE] = 0;
-    blocks_count[TOTAL] = 0;
+void MallocMetadata::clearFlag(BlockFlag flag) {
+    __atomic_fetch_and(&size_and_flags, ~(size_t)flag, __ATOMIC_RELAXED);
+}
 
-    bytes_count[FREE] = 0;
-    bytes_count[TOTAL] = 0;
+void *MallocMetadata::getPayloadBlockAddr() {
+    return (void*)(this + 1);
 }
 
-MallocMetadata* HeapBlocksList::findFreeBlock(size_t payload_size) {
-    MallocMetadata* curr_block_metadata = head;
+MallocMetadata* MallocMetadata::getBlockMetadata(void *payload_addr) {
+    return (MallocMetadata*)payload_addr - 1;
+}
 
-    while (curr_block_metadata != NULL) {
-        if (curr_block_metadata->is_free
-            && curr_block_metadata->size[TOTAL_PAYLOAD] >= payload_size) {
-            break;
-        }
-        curr_block_metadata = curr_block_metadata->next;
-    }
+size_t MallocMetadata::getMMappedPrefixSize() {
+    return *((size_t*)this - 1);
+}
 
-    return curr_block_metadata;
+void MallocMetadata::setMMappedPrefixSize(size_t prefix_size) {
+    *((size_t*)this - 1) = prefix_size;
 }
 
-void *HeapBlocksList::allocateBlock(size_t payload_size) {
-    MallocMetadata* free_block_metadata = findFreeBlock(payload_size);
-    void* payload_block_addr = NULL;
+uint64_t MallocMetadata::getMMappedAllocationTimeMs() {
+    return *((uint64_t*)this - 2);
+}
 
-    if (free_block_metadata == NULL && tail != NULL && tail->is_free) {
-        // enlarge “Wilderness” block and use it
-        payload_block_addr = useWildernessBlock(payload_size);
-    }
-    else if (free_block_metadata == NULL) {
-        // must allocate a new block
-        payload_block_addr = createNewBlock(payload_size);
-    }
-    else {
-        // use free block and also do splitting if needed
-        payload_block_addr = useFreeBlock(free_block_metadata, payload_size);
-    }
+void MallocMetadata::setMMappedAllocationTimeMs(uint64_t time_ms) {
+    *((uint64_t*)this - 2) = time_ms;
+}
 
-    return payload_block_addr;
+MallocMetadata* MallocMetadata::getNextBlock() {
+    return (MallocMetadata*)((char*)this + getBlockSize());
 }
 
-void *HeapBlocksList::createNewBlock(size_t payload_size) {
-    void* old_prog_break = sbrk(0);
-    size_t total_allocation_size = sizeof(MallocMetadata) + payload_size;
+MallocMetadata* MallocMetadata::getPrevBlock() {
+    size_t prev_block_size = *((size_t*)this - 1);
+    return (MallocMetadata*)((char*)this - prev_block_size);
+}
 
-    if (sbrk(total_allocation_size) == (void*)-1) {
-        // sbrk() failed
-        return NULL;
-    }
+void MallocMetadata::writeFooter() {
+    *((size_t*)getNextBlock() - 1) = getBlockSize();
+}
 
-    auto* new_block_metadata = (MallocMetadata*)old_prog_break;
-    setNewBlockMetaData(payload_size, new_block_metadata);
+MallocMetadata*& MallocMetadata::nextFree() {
+    return ((MallocMetadata**)getPayloadBlockAddr())[0];
+}
 
-    if (head == NULL) { // list empty
-        head = new_block_metadata;
-        tail = head;
+MallocMetadata*& MallocMetadata::prevFree() {
+    return ((MallocMetadata**)getPayloadBlockAddr())[1];
+}
+
+bool MallocMetadata::isCached() {
+    // HUGETLB_FLAG of mmapped blocks
+    return (__atomic_load_n(&size_and_flags, __ATOMIC_RELAXED)
+            & (MMAPPED_FLAG | CACHED_FLAG)) == CACHED_FLAG;
+}
+
+void MallocMetadata::setCached(bool is_cached) {
+    if (is_cached) {
+        setFlag(CACHED_FLAG);
     } else {
-        tail->next = new_block_metadata;
-        tail = new_block_metadata;
+        clearFlag(CACHED_FLAG);
     }
+}
 
-    blocks_count[TOTAL]++;
-    // blocks_count[FREE] doesn't change
-    bytes_count[TOTAL] += total_allocation_size;
-    // bytes_count[FREE] doesn't change
+// size of the block that can hold @payload_size bytes
+size_t getBlockSizeForPayload(size_t payload_size) {
+    size_t block_size = (sizeof(MallocMetadata) + payload_size
+                         + BLOCK_SIZE_ALIGNMENT - 1)
+                        & ~BLOCK_FLAGS_MASK;
 
-    return new_block_metadata->getPayloadBlockAddr();
+    return block_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : block_size;
 }
 
-void HeapBlocksList::setNewBlockMetaData(size_t payload_size,
-        MallocMetadata* block_metadata) {
-    block_metadata->is_free = false;
+/* free blocks are kept in segregated bins by block size, alongside the
+ * address-ordered sequence of all blocks. Bins below 256 bytes are 16 bytes
+ * wide, above that every power of two is divided into 4 bins. The last bin
+ * catches all the larger blocks */
+const size_t FREE_BINS_COUNT = 128;
+const size_t SMALL_FREE_BINS_COUNT = 16;
+const size_t SMALL_FREE_BIN_WIDTH = 16;
+const size_t BITMAP_WORD_BITS = 64;
 
-    block_metadata->size[TOTAL_PAYLOAD] = payload_size;
-    block_metadata->size[ACTIVE_PAYLOAD] = payload_size;
+const size_t SPLITTING_THRESHOLD = SMALLOC_SPLITTING_THRESHOLD;
+static_assert(sizeof(MallocMetadata) + SPLITTING_THRESHOLD >= MIN_BLOCK_SIZE,
+              "a split off block must be able to be free on its own");
 
-    block_metadata->next = NULL;
-    block_metadata->prev = tail;
-}
+// ----------------------------------------------------------------------------
 
-void *HeapBlocksList::useFreeBlock(MallocMetadata* free_block_metadata,
-        size_t new_active_payload_size) {
+/* what each page of the address space holds, in two levels like a page
+ * table. Leaves are mapped on first use and never unmapped, and only their
+ * pages with entries get touched. Lookups take no lock and never read the
+ * memory they look up, so any address can be looked up */
+const size_t PAGE_MAP_PAGE_SHIFT = 12;
+const size_t PAGE_MAP_ADDRESS_BITS = 48;
+const size_t PAGE_MAP_LEAF_BITS = 18;
+const size_t PAGE_MAP_LEAF_SIZE = (size_t)1 << PAGE_MAP_LEAF_BITS;
+const size_t PAGE_MAP_ROOT_SIZE = (size_t)1 << (PAGE_MAP_ADDRESS_BITS
+                                                - PAGE_MAP_PAGE_SHIFT
+                                                - PAGE_MAP_LEAF_BITS);
+
+typedef enum {
+    PAGE_UNKNOWN = 0,
+    // holds the start of the payload of an mmapped block
+    PAGE_MMAPPED_BLOCK = 1,
+    // in the heap of an arena. Those of arenas[i] hold PAGE_HEAP + i
+    PAGE_HEAP = 2
+} PageKind;
+
+class PageMap {
+public:
+    std::atomic<std::atomic<uint8_t>*> leaves[PAGE_MAP_ROOT_SIZE];
+
+    // a PageKind, or PAGE_HEAP plus an arena index
+    uint8_t get(void* addr);
+
+    // false if a leaf was needed and couldn't be mapped
+    bool set(void* addr, uint8_t entry);
 
-    size_t remaining_payload_size = 0;
-    if (free_block_metadata->size[TOTAL_PAYLOAD] - new_active_payload_size > sizeof(MallocMetadata)) {
-        remaining_payload_size =
-                free_block_metadata->size[TOTAL_PAYLOAD]
-                - new_active_payload_size
-                - sizeof(MallocMetadata); // for metadata of remaining block
+    // every page overlapping the range
+    bool setRange(void* start, size_t size, uint8_t entry);
+
+    /* only the pages wholly inside the range, the others are shared with
+     * what lies next to it */
+    void clearRange(void* start, size_t size);
+};
+
+uint8_t PageMap::get(void *addr) {
+    uintptr_t page = (uintptr_t)addr >> PAGE_MAP_PAGE_SHIFT;
+    if (page >> PAGE_MAP_LEAF_BITS >= PAGE_MAP_ROOT_SIZE) {
+        return PAGE_UNKNOWN;
     }
 
-    if (remaining_payload_size < SPLITTING_THRESHOLD) {
-        // remaining size to small, don't split
-        useFreeBlockWithoutSplit(free_block_metadata,
-                new_active_payload_size);
-    } else {
-        useFreeBlockWithSplit(free_block_metadata,
-                new_active_payload_size, remaining_payload_size);
+    std::atomic<uint8_t>* leaf = leaves[page >> PAGE_MAP_LEAF_BITS].load(
+            std::memory_order_acquire);
+    if (leaf == NULL) {
+        return PAGE_UNKNOWN;
     }
 
-    return free_block_metadata->getPayloadBlockAddr();
+    return leaf[page & (PAGE_MAP_LEAF_SIZE - 1)].load(std::memory_order_relaxed);
 }
 
-void HeapBlocksList::useFreeBlockWithoutSplit(MallocMetadata* original_block_metadata,
-        size_t new_active_payload_size) {
-    original_block_metadata->is_free = false;
-    original_block_metadata->size[ACTIVE_PAYLOAD] = new_active_payload_size;
+bool PageMap::set(void *addr, uint8_t entry) {
+    // mmap() doesn't hand out addresses beyond PAGE_MAP_ADDRESS_BITS
+    uintptr_t page = (uintptr_t)addr >> PAGE_MAP_PAGE_SHIFT;
+    std::atomic<std::atomic<uint8_t>*>& root_entry =
+            leaves[page >> PAGE_MAP_LEAF_BITS];
 
-    // blocks_count[TOTAL] doesn't change
-    blocks_count[FREE]--;
-    // bytes_count[TOTAL] doesn't change
-    bytes_count[FREE] -= original_block_metadata->size[TOTAL_PAYLOAD];
-}
+    std::atomic<uint8_t>* leaf = root_entry.load(std::memory_order_acquire);
+    if (leaf == NULL) {
+        if (entry == PAGE_UNKNOWN) {
+            return true;
+        }
 
-void HeapBlocksList::useFreeBlockWithSplit(MallocMetadata* original_block_metadata,
-        size_t new_active_payload_size, size_t remaining_payload_size) {
+        system_calls_counters.count(MMAP_CALL);
+        void* leaf_addr = mmap(NULL, PAGE_MAP_LEAF_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+        if (leaf_addr == MAP_FAILED) {
+            return false;
+        }
 
-    auto* remaining_block_metadata =
-            (MallocMetadata*)((char*)original_block_metadata
-                              + sizeof(MallocMetadata)
-                              + new_active_payload_size);
+        leaf = (std::atomic<uint8_t>*)leaf_addr;
+        std::atomic<uint8_t>* other_leaf = NULL;
+        if (!root_entry.compare_exchange_strong(other_leaf, leaf,
+                std::memory_order_acq_rel)) {
+            // another thread mapped it first
+            system_calls_counters.count(MUNMAP_CALL);
+            munmap(leaf_addr, PAGE_MAP_LEAF_SIZE);
+            leaf = other_leaf;
+        }
+    }
 
-    updateMetaDataAfterFreeBlockSplit(original_block_metadata,
-            remaining_block_metadata,
-            new_active_payload_size,
-            remaining_payload_size);
+    leaf[page & (PAGE_MAP_LEAF_SIZE - 1)].store(entry, std::memory_order_relaxed);
+    return true;
+}
 
-    if (tail == original_block_metadata) {
-        tail = remaining_block_metadata;
+bool PageMap::setRange(void *start, size_t size, uint8_t entry) {
+    const uintptr_t page_size = (uintptr_t)1 << PAGE_MAP_PAGE_SHIFT;
+
+    for (uintptr_t page_addr = (uintptr_t)start & ~(page_size - 1);
+         page_addr < (uintptr_t)start + size; page_addr += page_size) {
+        if (!set((void*)page_addr, entry)) {
+            return false;
+        }
     }
 
-    blocks_count[TOTAL]++;
-    /* blocks_count[FREE] doesn't change because original block becomes used but
-     * remaining block is now counted as a new free block */
-    // bytes_count[TOTAL] doesn't change
-    bytes_count[FREE] -= new_active_payload_size
-                         + sizeof(MallocMetadata); // because of remaining block
+    return true;
 }
 
-void HeapBlocksList::updateMetaDataAfterFreeBlockSplit(MallocMetadata *original_block_metadata,
-        MallocMetadata *remaining_block_metadata,
-        size_t new_active_payload_size,
-        size_t remaining_payload_size) {
+void PageMap::clearRange(void *start, size_t size) {
+    const uintptr_t page_size = (uintptr_t)1 << PAGE_MAP_PAGE_SHIFT;
 
-    original_block_metadata->is_free = false;
-    original_block_metadata->size[ACTIVE_PAYLOAD] = new_active_payload_size;
-    original_block_metadata->size[TOTAL_PAYLOAD] = new_active_payload_size;
-
-    remaining_block_metadata->next = original_block_metadata->next;
-    if (original_block_metadata->next != NULL) {
-        original_block_metadata->next->prev = remaining_block_metadata;
+    for (uintptr_t page_addr = ((uintptr_t)start + page_size - 1)
+                               & ~(page_size - 1);
+         page_addr + page_size <= (uintptr_t)start + size;
+         page_addr += page_size) {
+        set((void*)page_addr, PAGE_UNKNOWN);
     }
-    original_block_metadata->next = remaining_block_metadata;
-    remaining_block_metadata->prev = original_block_metadata;
-
-    remaining_block_metadata->is_free = true;
-    remaining_block_metadata->size[TOTAL_PAYLOAD] = remaining_payload_size;
-    remaining_block_metadata->size[ACTIVE_PAYLOAD] = 0;
 }
 
-void* HeapBlocksList::useWildernessBlock(size_t payload_size) {
-    // here wilderness block is free
+// zero initialized before any constructor runs
+PageMap page_map;
 
-    MallocMetadata* wilderness_block_metadata = tail;
+// ----------------------------------------------------------------------------
 
-    size_t extra_needed_size = payload_size
-                               - wilderness_block_metadata->size[TOTAL_PAYLOAD];
+// virtual address space reserved for the heap of every non main arena
+const size_t ARENA_REGION_SIZE = (size_t)1024 * 1024 * KB;
 
-    if (sbrk(extra_needed_size) == (void*)-1) {
-        // sbrk() failed
-        return NULL;
-    }
+const size_t DEFAULT_TRIM_THRESHOLD = 128 * KB;
+const size_t DEFAULT_MIN_HEAP_GROWTH_SIZE = 128 * KB;
+const size_t DEFAULT_MAX_HEAP_GROWTH_SIZE = 2 * 1024 * KB;
 
-    // blocks_count[TOTAL] doesn't change
-    blocks_count[FREE]--;
-    bytes_count[TOTAL] += extra_needed_size;
-    bytes_count[FREE] -= wilderness_block_metadata->size[TOTAL_PAYLOAD];
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * KB;
 
-    wilderness_block_metadata->is_free = false;
-    wilderness_block_metadata->size[TOTAL_PAYLOAD] = payload_size;
-    wilderness_block_metadata->size[ACTIVE_PAYLOAD] = payload_size;
+/* the heap ends this many bytes after its top chunk. When others moved the
+ * program break, the metadata of the fence block over their memory goes
+ * there, see HeapBlocksList::growTop() */
+const size_t HEAP_END_RESERVE_SIZE = BLOCK_SIZE_ALIGNMENT;
+static_assert(HEAP_END_RESERVE_SIZE >= sizeof(MallocMetadata),
+              "the metadata of a fence block must fit in the heap end");
 
-    return wilderness_block_metadata->getPayloadBlockAddr();
-}
+/* bytes_count[FREE] counts the payload of free blocks, bytes_count[TOTAL]
+ * the whole heap including metadata, without the top chunk */
+class HeapBlocksList;
 
-void HeapBlocksList::releaseUsedBlock(void *payload_addr) {
-    // here payload_addr != NULL
+/* how the free block an allocation gets is picked, chosen at compile time
+ * with SMALLOC_FIT_POLICY. All of them search the segregated free bins, in
+ * which blocks of larger bins are larger, and return NULL if no block fits */
 
-    auto *block_metadata = (MallocMetadata*)payload_addr - 1;
-    if (block_metadata->is_free) {
-        // we allow double free
-        return;
-    }
+/* the most recently freed block that fits, in the matching bin or else the
+ * next non empty one. Its memory is the likeliest to be in the cache */
+class LifoFitPolicy {
+public:
+    MallocMetadata* findFreeBlock(HeapBlocksList& heap, size_t block_size);
+};
 
-    bool combine_with_succ = block_metadata->next != NULL
-                             && block_metadata->next->is_free;
+/* the lowest addressed block that fits, which keeps the end of the heap free
+ * to be trimmed. Looks at every block that fits */
+class FirstFitPolicy {
+public:
+    MallocMetadata* findFreeBlock(HeapBlocksList& heap, size_t block_size);
+};
 
-    bool combine_with_pred = block_metadata->prev != NULL
-                             && block_metadata->prev->is_free;
+/* first fit from where the last allocation ended, wrapping around to the
+ * start of the heap, which spreads small remnants over the heap */
+class NextFitPolicy {
+public:
+    char* rover = NULL;
 
-    if (combine_with_succ && combine_with_pred) {
-        combineFreeBlockWithSuccAndPred(block_metadata);
-    }
-    else if (combine_with_succ) {
-        combineFreeBlockWithSucc(block_metadata);
-    }
-    else if (combine_with_pred) {
-        combineFreeBlockWithPred(block_metadata);
-    }
-    else {
-        freeBlockWithoutCombining(block_metadata);
-    }
-}
+    MallocMetadata* findFreeBlock(HeapBlocksList& heap, size_t block_size);
+};
 
-void HeapBlocksList::combineFreeBlockWithSucc(MallocMetadata *block_metadata) {
-    // here block_metadata->next != NULL
+// the smallest block that fits, leaving the least remnant
+class BestFitPolicy {
+public:
+    MallocMetadata* findFreeBlock(HeapBlocksList& heap, size_t block_size);
+};
 
-    MallocMetadata* succ_metadata = block_metadata->next;
+const size_t GOOD_FIT_MAX_CANDIDATES = 8;
 
-    if (succ_metadata->next != NULL) {
-        succ_metadata->next->prev = block_metadata;
-    }
-    block_metadata->next = succ_metadata->next;
-    if (tail == succ_metadata) {
-        tail = block_metadata;
-    }
+// the smallest of the first GOOD_FIT_MAX_CANDIDATES blocks that fit
+class GoodFitPolicy {
+public:
+    MallocMetadata* findFreeBlock(HeapBlocksList& heap, size_t block_size);
+};
 
-    blocks_count[TOTAL]--;
-    // blocks_count[FREE] doesn't change
-    // bytes_count[TOTAL] doesn't change
-    bytes_count[FREE] += sizeof(MallocMetadata)
-                         + block_metadata->size[TOTAL_PAYLOAD];
+typedef SMALLOC_FIT_POLICY FitPolicy;
 
-    block_metadata->is_free = true;
-    block_metadata->size[TOTAL_PAYLOAD] += sizeof(MallocMetadata)
-                                           + succ_metadata->size[TOTAL_PAYLOAD];
-    block_metadata->size[ACTIVE_PAYLOAD] = 0;
-}
+class HeapBlocksList {
+public:
+    // first and last blocks in memory
+    MallocMetadata *head, *tail;
+    size_t blocks_count[2];
+    size_t bytes_count[2];
 
-void HeapBlocksList::combineFreeBlockWithPred(MallocMetadata *block_metadata) {
-    // here block_metadata->prev != NULL
-    MallocMetadata* pred_metadata = block_metadata->prev;
+    /* the heap of the main arena grows with sbrk(). Other heaps grow inside
+     * a region reserved with mmap(), whose pages are made accessible on
+     * demand */
+    bool is_sbrk_heap;
+    // atomic because other threads look up block owners through it
+    std::atomic<char*> region_start;
+    char *region_break, *region_accessible_end;
+    // set by the first growth, atomic for the same reason
+    std::atomic<char*> heap_start;
+
+    MallocMetadata* free_bins[FREE_BINS_COUNT];
+    // bit i is on iff free_bins[i] isn't empty
+    uint64_t non_empty_free_bins[FREE_BINS_COUNT / BITMAP_WORD_BITS];
+
+    /* the heap is taken from the OS in chunks. The space after the tail
+     * block that isn't used yet is the top chunk, new blocks are cut from
+     * its start. HEAP_END_RESERVE_SIZE bytes follow it */
+    char* top_start;
+    size_t top_size;
+    /* the OS hands out zeroed pages, so the top chunk from here on is known
+     * to be zero. Below it the space may have been used by trimmed blocks */
+    char* top_zero_start;
+    // size of the next chunk, doubled after each growth up to max
+    size_t growth_size;
+    size_t min_growth_size, max_growth_size;
+    // end every chunk on a huge page boundary and advise it for THP
+    bool use_huge_pages;
+
+    /* free space at the end of the heap beyond this is trimmed when a block
+     * is released. top_pad bytes of it are always kept */
+    size_t trim_threshold;
+    size_t top_pad;
+
+    // for smalloc_stats()
+    size_t splits_count, coalesces_count;
+
+    /* for smalloc_fragmentation(). Updated as blocks enter and leave the
+     * free bins, so they need no walk of the heap */
+    size_t free_blocks_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+    size_t free_bytes_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+    // free blocks with less payload than SPLITTING_THRESHOLD
+    size_t small_free_blocks_count;
+
+    FitPolicy fit_policy;
+
+    constexpr explicit HeapBlocksList(bool is_sbrk_heap);
+
+    /* move the end of the heap by @increment bytes like sbrk(). Return the
+     * old end of the heap, or (void*)-1 on failure */
+    void* extendHeap(size_t increment);
+
+    /* cut @size bytes from the start of the top chunk, growing the heap if
+     * needed. Return their address, or (void*)-1 on failure. They follow the
+     * tail block, unless growing the heap changed the tail, see growTop() */
+    void* allocateFromTop(size_t size);
+
+    /* grow the top chunk by at least @min_increment bytes. If others moved
+     * the program break since the last growth, the top chunk starts over
+     * after their memory, which fenceOffTop() walls off */
+    bool growTop(size_t min_increment);
+
+    /* make the rest of the top chunk a free block if it is large enough,
+     * and append a used fence block from there up to @new_top_start, over
+     * memory others got from sbrk(). The fence is never freed */
+    void fenceOffTop(char* new_top_start);
+
+    /* make the top chunk at least @size bytes long, and keep that much of
+     * it when trimming */
+    bool reserveTop(size_t size);
+
+    // free tail block and top chunk
+    size_t getFreeEndSize();
+
+    // add the blocks of the heap to @stats, walking all of them
+    void addToStats(SmallocStats& stats);
+
+    // add the free blocks to @fragmentation from the bins' counters
+    void addToFragmentation(SmallocFragmentation& fragmentation);
+
+    // payload of the largest free block, 0 if there is none
+    size_t getLargestFreeBlockSize();
+
+    // update the counters of the free bins when a block enters or leaves them
+    void countFreeBinBlock(MallocMetadata* block_metadata, bool is_inserted);
+
+    /* move the end of the heap back by @decrement bytes and give the pages
+     * above it to the OS. Return false on failure */
+    bool shrinkHeap(size_t decrement);
+
+    /* give back the free space at the end of the heap except for @pad bytes.
+     * The free tail block keeps at least MIN_BLOCK_SIZE bytes. Return true if
+     * the heap shrank */
+    bool trimHeap(size_t pad);
+
+    /* let the OS reclaim the whole pages inside free blocks. Their contents
+     * are lost, except for the bin links and the boundary tag. Return true if
+     * any page was released */
+    bool releaseFreeBlocksPages();
+
+    bool ownsRegionAddress(void* addr);
+
+    /* for any heap. The sbrk() heap ends at the program break, so it owns
+     * memory others got from sbrk() after it grew */
+    bool ownsHeapAddress(void* addr);
+
+    // NULL if @block_metadata is the last block
+    MallocMetadata* getSuccBlock(MallocMetadata* block_metadata);
 
-    if (block_metadata->next != NULL) {
-        block_metadata->next->prev = pred_metadata;
-    }
-    pred_metadata->next = block_metadata->next;
-    if (tail == block_metadata) {
-        tail = pred_metadata;
-    }
+    // NULL if the previous block isn't free
+    MallocMetadata* getFreePredBlock(MallocMetadata* block_metadata);
+
+    // update PREV_FREE_FLAG of the block after @block_metadata, if any
+    void setSuccPrevFreeFlag(MallocMetadata* block_metadata, bool is_free);
 
-    pred_metadata->size[TOTAL_PAYLOAD] += sizeof(MallocMetadata)
-                                          + block_metadata->size[TOTAL_PAYLOAD];
+    void* allocateBlock(size_t payload_size);
 
-    blocks_count[TOTAL]--;
-    // blocks_count[FREE] doesn't change
-    // bytes_count[TOTAL] doesn't change
-    bytes_count[FREE] += sizeof(MallocMetadata)
-                         + block_metadata->size[TOTAL_PAYLOAD];
-}
+    /* like allocateBlock(), but only from a free block. NULL if none fits,
+     * the top chunk and the heap stay as they are */
+    void* allocateFreeBlock(size_t payload_size);
 
-void HeapBlocksList::combineFreeBlockWithSuccAndPred(MallocMetadata *block_metadata) {
-    combineFreeBlockWithSucc(block_metadata);
-    combineFreeBlockWithPred(block_metadata);
+    /* @alignment is a power of 2 larger than BLOCK_SIZE_ALIGNMENT. The
+     * space before the aligned payload is split off as a free block */
+    void* allocateAlignedBlock(size_t alignment, size_t payload_size);
 
-    blocks_count[FREE]--;
-    bytes_count[FREE] -= block_metadata->size[TOTAL_PAYLOAD];
-}
+    void* allocateZeroedBlock(size_t payload_size);
 
-void HeapBlocksList::freeBlockWithoutCombining(MallocMetadata* block_metadata) {
-    block_metadata->is_free = true;
-    block_metadata->size[ACTIVE_PAYLOAD] = 0;
+    /* allocate @addrs_count blocks of @payload_size bytes into
+     * @payload_addrs, cut from one block found for all of them. Return the
+     * number of blocks allocated */
+    size_t allocateBlocks(size_t payload_size, size_t addrs_count,
+            void** payload_addrs);
 
-    // blocks_count[TOTAL] doesn't change
-    blocks_count[FREE]++;
-    // bytes_count[TOTAL] doesn't change
-    bytes_count[FREE] += block_metadata->size[TOTAL_PAYLOAD];
-}
+    MallocMetadata* findFreeBlock(size_t block_size);
 
-void *HeapBlocksList::allocateZeroedBlock(size_t payload_size) {
-    void* payload_block_addr = allocateBlock(payload_size);
+    /* the free block after @block_metadata that can hold @block_size bytes,
+     * in the order of the bins starting from the matching one. The first
+     * one if @block_metadata is NULL, and NULL after the last one */
+    MallocMetadata* getNextFittingBlock(MallocMetadata* block_metadata,
+            size_t block_size);
 
-    if (payload_block_addr != NULL) {
-        // zeroing only the part of block the user asked for
-        memset(payload_block_addr, 0, payload_size);
-    }
+    static size_t getFreeBinIndex(size_t block_size);
 
-    return payload_block_addr;
-}
+    /* return the index of the first non empty bin whose index is at least
+     * @first_bin_index, or FREE_BINS_COUNT if there is none */
+    size_t findNonEmptyFreeBin(size_t first_bin_index);
 
-void *HeapBlocksList::reallocateActiveBlock(void *old_payload_addr,
-        size_t new_payload_size) {
+    void insertToFreeBin(MallocMetadata* block_metadata);
 
-    if (old_payload_addr == NULL) {
-        // act like a call to smalloc(new_payload_size)
-        return allocateBlock(new_payload_size);
-    }
+    void removeFromFreeBin(MallocMetadata* block_metadata);
 
-    auto *old_block_metadata = (MallocMetadata*)old_payload_addr - 1;
+    void* createNewBlock(size_t block_size);
 
-    if (old_block_metadata->size[TOTAL_PAYLOAD] >= new_payload_size) {
-        // current block is large enough
-        return reallocateWithSameBlock(old_block_metadata, new_payload_size);
-    }
-    if (tail == old_block_metadata
-        && reallocateWildernessBlock(new_payload_size) != NULL) {
-        // enlarge and use Wilderness block.
-        // if sbrk() fails continue to other options
-        return old_payload_addr;
-    }
-    if (canReallocateUsingPredOrSucc(old_block_metadata, new_payload_size)) {
-        return reallocateUsingPredOrSucc(old_block_metadata, new_payload_size);
-    }
+    // make the @block_size bytes at @block_addr, after the tail, a used tail
+    void appendBlock(void* block_addr, size_t block_size);
 
-    // otherwise, try to find a different block
-    return reallocateToOtherBlock(old_block_metadata, old_payload_addr,
-            new_payload_size);
+    void* useFreeBlock(MallocMetadata* free_block_metadata, size_t block_size);
+
+    void* useWildernessBlock(size_t block_size);
+
+    /* @block_metadata is of a used block. If it is larger than @block_size
+     * by enough to hold a block with SPLITTING_THRESHOLD payload bytes, cut
+     * it to @block_size and free the remaining block */
+    void splitUsedBlock(MallocMetadata* block_metadata, size_t block_size);
+
+    void releaseUsedBlock(void* payload_addr);
+
+    /* @payload_addrs are of used blocks, sorted by address. Runs of adjacent
+     * blocks are merged into one block before it is freed */
+    void releaseUsedBlocks(void** payload_addrs, size_t addrs_count);
+
+    // @block_metadata is of a used block, possibly a cached one
+    void freeBlock(MallocMetadata* block_metadata);
+
+    void combineFreeBlockWithSucc(MallocMetadata* block_metadata);
+
+    void combineFreeBlockWithPred(MallocMetadata* block_metadata);
+
+    void combineFreeBlockWithSuccAndPred(MallocMetadata* block_metadata);
+
+    void freeBlockWithoutCombining(MallocMetadata* block_metadata);
+
+    void* reallocateActiveBlock(void* old_payload_addr, size_t new_payload_size);
+
+    void* reallocateWithSameBlock(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    void* reallocateWildernessBlock(size_t block_size);
+
+    bool canReallocateUsingPredOrSucc(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    bool canReallocateUsingPredOnly(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    bool canReallocateUsingSuccOnly(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    bool canReallocateUsingPredAndSucc(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    void* reallocateUsingPredOrSucc(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    void* reallocateUsingPredOnly(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    void* reallocateUsingSuccOnly(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    void* reallocateUsingPredAndSucc(MallocMetadata* old_block_metadata,
+            size_t block_size);
+
+    void* reallocateToOtherBlock(MallocMetadata* old_block_metadata,
+            void * old_payload_addr, size_t new_payload_size);
+};
+
+/* what the page map holds for the pages of @heap_blocks_list, PAGE_HEAP
+ * plus the index of its arena */
+uint8_t getHeapPageEntry(HeapBlocksList* heap_blocks_list);
+
+// ----------------------------------------------------------------------------
+
+constexpr HeapBlocksList::HeapBlocksList(bool is_sbrk_heap)
+        : head(NULL), tail(NULL), blocks_count(), bytes_count(),
+          is_sbrk_heap(is_sbrk_heap),
+          region_start(NULL), region_break(NULL), region_accessible_end(NULL),
+          heap_start(NULL), free_bins(), non_empty_free_bins(),
+          top_start(NULL), top_size(0), top_zero_start(NULL),
+          growth_size(DEFAULT_MIN_HEAP_GROWTH_SIZE),
+          min_growth_size(DEFAULT_MIN_HEAP_GROWTH_SIZE),
+          max_growth_size(DEFAULT_MAX_HEAP_GROWTH_SIZE),
+          use_huge_pages(false),
+          trim_threshold(DEFAULT_TRIM_THRESHOLD), top_pad(0),
+          splits_count(0), coalesces_count(0),
+          free_blocks_by_size_class(), free_bytes_by_size_class(),
+          small_free_blocks_count(0), fit_policy()
+{
 }
 
-void* HeapBlocksList::reallocateWithSameBlock(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
+void* HeapBlocksList::extendHeap(size_t increment) {
+    if (is_sbrk_heap) {
+        if (increment == 0) {
+            return sbrk(0);
+        }
+
+        system_calls_counters.count(SBRK_CALL);
+        void* old_heap_end = sbrk(increment);
+        if (old_heap_end != (void*)-1
+            && !page_map.setRange(old_heap_end, increment,
+                                  getHeapPageEntry(this))) {
+            // blocks in pages the page map doesn't know couldn't be freed
+            page_map.clearRange(old_heap_end, increment);
+            system_calls_counters.count(SBRK_CALL);
+            sbrk(-(intptr_t)increment);
+            return (void*)-1;
+        }
+        return old_heap_end;
+    }
 
-    size_t remaining_payload_size = 0;
-    if (old_block_metadata->size[TOTAL_PAYLOAD] - new_payload_size > sizeof(MallocMetadata)) {
-        remaining_payload_size = old_block_metadata->size[TOTAL_PAYLOAD]
-                                 - new_payload_size
-                                 - sizeof(MallocMetadata);
+    if (region_start == NULL) {
+        system_calls_counters.count(MMAP_CALL);
+        void* region_addr = mmap(NULL, ARENA_REGION_SIZE, PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0);
+        if (region_addr == MAP_FAILED) {
+            return (void*)-1;
+        }
+        region_break = (char*)region_addr;
+        region_accessible_end = (char*)region_addr;
+        region_start.store((char*)region_addr, std::memory_order_release);
     }
 
-    if (remaining_payload_size >= SPLITTING_THRESHOLD) {
-        splitUsedBlock(old_block_metadata, new_payload_size,
-                remaining_payload_size);
+    if (increment > (size_t)(region_start + ARENA_REGION_SIZE - region_break)) {
+        // region exhausted
+        return (void*)-1;
     }
 
-    old_block_metadata->size[ACTIVE_PAYLOAD] = new_payload_size;
+    char* new_region_break = region_break + increment;
+    if (new_region_break > region_accessible_end) {
+        size_t page_size = getpagesize();
+        char* new_accessible_end = region_start
+                + (new_region_break - region_start.load() + page_size - 1)
+                  / page_size * page_size;
+
+        /* the region is reserved for this heap, so its pages are never
+         * cleared from the page map */
+        if (!page_map.setRange(region_accessible_end,
+                               new_accessible_end - region_accessible_end,
+                               getHeapPageEntry(this))) {
+            return (void*)-1;
+        }
 
-    return old_block_metadata->getPayloadBlockAddr();
+        system_calls_counters.count(MPROTECT_CALL);
+        if (mprotect(region_accessible_end,
+                     new_accessible_end - region_accessible_end,
+                     PROT_READ | PROT_WRITE) != 0) {
+            return (void*)-1;
+        }
+        region_accessible_end = new_accessible_end;
+    }
+
+    void* old_region_break = region_break;
+    region_break = new_region_break;
+
+    return old_region_break;
+}
+
+void* HeapBlocksList::allocateFromTop(size_t size) {
+    // growTop() may give the rest of the top chunk to a free block
+    while (top_size < size) {
+        if (!growTop(size - top_size)) {
+            return (void*)-1;
+        }
+    }
+
+    void* allocated_addr = top_start;
+    top_start += size;
+    top_size -= size;
+
+    return allocated_addr;
 }
 
-void HeapBlocksList::splitUsedBlock(MallocMetadata *old_block_metadata,
-        size_t new_payload_size, size_t remaining_payload_size) {
-    // here remaining_payload_size >= 128
-    auto* remaining_block_metadata =
-            (MallocMetadata*)((char*)old_block_metadata
-                              + sizeof(MallocMetadata)
-                              + new_payload_size);
+bool HeapBlocksList::growTop(size_t min_increment) {
+    size_t page_size = getpagesize();
+    // room to align a top chunk that starts over, and for the heap end
+    min_increment += BLOCK_SIZE_ALIGNMENT + HEAP_END_RESERVE_SIZE;
+    size_t increment = (max(min_increment, growth_size) + page_size - 1)
+                       / page_size * page_size;
+
+    if (use_huge_pages) {
+        /* extending by 0 returns the current end of the heap, which isn't
+         * the end of the top chunk if others moved the program break */
+        uintptr_t heap_end = (uintptr_t)extendHeap(0);
+        if (heap_end == (uintptr_t)-1) {
+            return false;
+        }
+        increment = ((heap_end + increment + HUGE_PAGE_SIZE - 1)
+                     & ~(uintptr_t)(HUGE_PAGE_SIZE - 1)) - heap_end;
+    }
 
-    old_block_metadata->size[TOTAL_PAYLOAD] = new_payload_size;
+    void* old_heap_end = extendHeap(increment);
+    if (old_heap_end == (void*)-1) {
+        // a whole chunk may not fit, try just what is needed
+        increment = min_increment;
+        old_heap_end = extendHeap(increment);
+        if (old_heap_end == (void*)-1) {
+            return false;
+        }
+    } else {
+        growth_size = min(2 * growth_size, max_growth_size);
+    }
 
-    remaining_block_metadata->is_free = true;
-    remaining_block_metadata->size[TOTAL_PAYLOAD] = remaining_payload_size;
-    remaining_block_metadata->size[ACTIVE_PAYLOAD] = 0;
+    if (use_huge_pages) {
+        // only whole huge pages can be backed by one
+        uintptr_t start = ((uintptr_t)old_heap_end + HUGE_PAGE_SIZE - 1)
+                          & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)old_heap_end + increment)
+                        & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+        if (start < end) {
+            system_calls_counters.count(MADVISE_CALL);
+            madvise((void*)start, end - start, MADV_HUGEPAGE);
+        }
+    }
 
-    if (old_block_metadata->next != NULL) {
-        old_block_metadata->next->prev = remaining_block_metadata;
+    if (top_start != NULL
+        && (char*)old_heap_end == top_start + top_size + HEAP_END_RESERVE_SIZE) {
+        top_size += increment;
+        return true;
     }
-    remaining_block_metadata->prev = old_block_metadata;
-    remaining_block_metadata->next = old_block_metadata->next;
-    old_block_metadata->next = remaining_block_metadata;
 
-    if (tail == old_block_metadata) {
-        tail = remaining_block_metadata;
+    /* first growth of the heap, or the new memory doesn't follow the old
+     * end. The top chunk starts over, padded so the first payload, and with
+     * it every payload, is aligned to BLOCK_SIZE_ALIGNMENT */
+    char* new_top_start = (char*)old_heap_end
+                          + (((uintptr_t)sizeof(MallocMetadata)
+                              - (uintptr_t)old_heap_end) & BLOCK_FLAGS_MASK);
+    if (top_start == NULL) {
+        heap_start.store(new_top_start, std::memory_order_release);
+    } else {
+        fenceOffTop(new_top_start);
     }
+    top_start = new_top_start;
+    top_size = (char*)old_heap_end + increment - HEAP_END_RESERVE_SIZE
+               - new_top_start;
+    // the rest of the page the new memory starts in may have been used by others
+    top_zero_start = (char*)(((uintptr_t)old_heap_end + page_size - 1)
+                             & ~(uintptr_t)(page_size - 1));
+
+    return true;
+}
 
-    blocks_count[TOTAL]++;
-    blocks_count[FREE]++;
-    // bytes_count[TOTAL] doesn't change
-    bytes_count[FREE] += remaining_payload_size;
+void HeapBlocksList::fenceOffTop(char *new_top_start) {
+    // the top chunk may end unaligned, past the last whole block
+    size_t free_block_size = top_size & ~BLOCK_FLAGS_MASK;
+    if (free_block_size >= MIN_BLOCK_SIZE) {
+        appendBlock(top_start, free_block_size);
+        freeBlock(tail);
+        top_start += free_block_size;
+        top_size -= free_block_size;
+    }
+
+    // its metadata is in the heap end, its payload is the memory of others
+    appendBlock(top_start, new_top_start - top_start);
 }
 
-void *HeapBlocksList::reallocateWildernessBlock(size_t new_payload_size) {
-    // here Wilderness block is free but not large enough
-    MallocMetadata* wilderness_block_metadata = tail;
+bool HeapBlocksList::reserveTop(size_t size) {
+    size = (size + BLOCK_FLAGS_MASK) & ~BLOCK_FLAGS_MASK;
+
+    // growTop() may give the rest of the top chunk to a free block
+    while (top_size < size) {
+        if (!growTop(size - top_size)) {
+            return false;
+        }
+    }
 
-    size_t extra_needed_size = new_payload_size
-                               - wilderness_block_metadata->size[TOTAL_PAYLOAD];
+    top_pad = max(top_pad, size);
 
-    if (sbrk(extra_needed_size) == (void*)-1) {
-        // sbrk() failed
+    return true;
+}
+
+size_t HeapBlocksList::getFreeEndSize() {
+    size_t free_end_size = top_size;
+    if (tail != NULL && tail->hasFlag(FREE_FLAG)) {
+        free_end_size += tail->getBlockSize();
+    }
+
+    return free_end_size;
+}
+
+void HeapBlocksList::addToStats(SmallocStats &stats) {
+    for (MallocMetadata* block_metadata = head; block_metadata != NULL;
+         block_metadata = getSuccBlock(block_metadata)) {
+        size_t payload_size = block_metadata->getPayloadSize();
+        size_t size_class = getStatsSizeClass(payload_size);
+
+        if (block_metadata->hasFlag(FREE_FLAG)) {
+            stats.heap.free_blocks++;
+            stats.heap.free_bytes += payload_size;
+            stats.free_blocks_by_size_class[size_class]++;
+            stats.largest_free_block = max(stats.largest_free_block,
+                                           payload_size);
+        } else {
+            stats.heap.used_blocks++;
+            stats.heap.used_bytes += payload_size;
+            stats.used_blocks_by_size_class[size_class]++;
+        }
+    }
+
+    stats.heap_top_bytes += top_size;
+    stats.splits_count += splits_count;
+    stats.coalesces_count += coalesces_count;
+}
+
+void HeapBlocksList::addToFragmentation(SmallocFragmentation &fragmentation) {
+    for (size_t i = 0; i < SMALLOC_STATS_SIZE_CLASSES_COUNT; i++) {
+        fragmentation.free_blocks += free_blocks_by_size_class[i];
+        fragmentation.free_bytes += free_bytes_by_size_class[i];
+        fragmentation.free_blocks_by_size_class[i] +=
+                free_blocks_by_size_class[i];
+        fragmentation.free_bytes_by_size_class[i] +=
+                free_bytes_by_size_class[i];
+    }
+
+    fragmentation.small_free_blocks += small_free_blocks_count;
+    fragmentation.largest_free_block = max(fragmentation.largest_free_block,
+                                           getLargestFreeBlockSize());
+}
+
+size_t HeapBlocksList::getLargestFreeBlockSize() {
+    // the last non empty bin holds the largest blocks
+    size_t word_index = FREE_BINS_COUNT / BITMAP_WORD_BITS;
+    while (word_index > 0 && non_empty_free_bins[word_index - 1] == 0) {
+        word_index--;
+    }
+    if (word_index == 0) {
+        return 0;
+    }
+
+    uint64_t word = non_empty_free_bins[word_index - 1];
+    size_t bin_index = (word_index - 1) * BITMAP_WORD_BITS
+                       + BITMAP_WORD_BITS - 1 - __builtin_clzl(word);
+
+    // blocks in a bin aren't sorted
+    size_t largest_block_size = 0;
+    for (MallocMetadata* block_metadata = free_bins[bin_index];
+         block_metadata != NULL; block_metadata = block_metadata->nextFree()) {
+        largest_block_size = max(largest_block_size,
+                                 block_metadata->getBlockSize());
+    }
+
+    return largest_block_size - sizeof(MallocMetadata);
+}
+
+void HeapBlocksList::countFreeBinBlock(MallocMetadata *block_metadata,
+        bool is_inserted) {
+    // heap blocks have no mmapped prefix
+    size_t payload_size = block_metadata->getBlockSize() - sizeof(MallocMetadata);
+    size_t size_class = getStatsSizeClass(payload_size);
+
+    if (is_inserted) {
+        free_blocks_by_size_class[size_class]++;
+        free_bytes_by_size_class[size_class] += payload_size;
+        small_free_blocks_count += payload_size < SPLITTING_THRESHOLD;
+    } else {
+        free_blocks_by_size_class[size_class]--;
+        free_bytes_by_size_class[size_class] -= payload_size;
+        small_free_blocks_count -= payload_size < SPLITTING_THRESHOLD;
+    }
+}
+
+bool HeapBlocksList::shrinkHeap(size_t decrement) {
+    if (is_sbrk_heap) {
+        if ((char*)sbrk(0) != top_start + top_size + HEAP_END_RESERVE_SIZE) {
+            // someone else moved the program break, it isn't ours to lower
+            return false;
+        }
+        system_calls_counters.count(SBRK_CALL);
+        if (sbrk(-(intptr_t)decrement) == (void*)-1) {
+            return false;
+        }
+
+        // others may get the released pages from sbrk()
+        page_map.clearRange(top_start + top_size + HEAP_END_RESERVE_SIZE
+                            - decrement, decrement);
+        return true;
+    }
+
+    region_break -= decrement;
+
+    // the pages stay accessible, so the heap can grow back cheaply
+    size_t page_size = getpagesize();
+    char* first_unused_page = (char*)(((uintptr_t)region_break + page_size - 1)
+                                      & ~(uintptr_t)(page_size - 1));
+    if (first_unused_page < region_accessible_end) {
+        system_calls_counters.count(MADVISE_CALL);
+        madvise(first_unused_page, region_accessible_end - first_unused_page,
+                MADV_DONTNEED);
+    }
+
+    return true;
+}
+
+bool HeapBlocksList::trimHeap(size_t pad) {
+    if (tail == NULL) {
+        return false;
+    }
+
+    /* a free tail block is kept even when pad is 0, as its pred can't be
+     * reached from it when the pred is used */
+    size_t releasable_size = getFreeEndSize();
+    if (tail->hasFlag(FREE_FLAG)) {
+        releasable_size -= MIN_BLOCK_SIZE;
+    }
+
+    pad = (pad + BLOCK_FLAGS_MASK) & ~BLOCK_FLAGS_MASK;
+    if (releasable_size <= pad
+        || releasable_size - pad < (size_t)getpagesize()) {
+        // not worth a system call
+        return false;
+    }
+
+    size_t released_size = releasable_size - pad;
+    if (!shrinkHeap(released_size)) {
+        return false;
+    }
+
+    if (released_size > top_size) {
+        // the rest comes from the free tail block
+        size_t released_block_size = released_size - top_size;
+
+        removeFromFreeBin(tail);
+        tail->setBlockSize(tail->getBlockSize() - released_block_size);
+        tail->writeFooter();
+        insertToFreeBin(tail);
+
+        // blocks_count[TOTAL] doesn't change
+        // blocks_count[FREE] doesn't change
+        bytes_count[TOTAL] -= released_block_size;
+        bytes_count[FREE] -= released_block_size;
+
+        top_start -= released_block_size;
+        top_size = 0;
+    } else {
+        top_size -= released_size;
+    }
+
+    /* released pages come back zeroed, but the rest of the page the heap
+     * now ends in keeps whatever was written there */
+    size_t page_size = getpagesize();
+    char* first_released_page = (char*)(((uintptr_t)(top_start + top_size)
+                                         + HEAP_END_RESERVE_SIZE + page_size - 1)
+                                        & ~(uintptr_t)(page_size - 1));
+    if (top_size == 0 || top_zero_start > first_released_page) {
+        top_zero_start = first_released_page;
+    }
+
+    // the heap grows again from small chunks
+    growth_size = min_growth_size;
+
+    return true;
+}
+
+bool HeapBlocksList::releaseFreeBlocksPages() {
+    size_t page_size = getpagesize();
+    bool released = false;
+
+    for (MallocMetadata* block_metadata = head; block_metadata != NULL;
+         block_metadata = getSuccBlock(block_metadata)) {
+        if (!block_metadata->hasFlag(FREE_FLAG)) {
+            continue;
+        }
+
+        // keep the bin links and the boundary tag
+        uintptr_t start = (uintptr_t)&block_metadata->prevFree() + sizeof(size_t);
+        uintptr_t end = (uintptr_t)block_metadata->getNextBlock() - sizeof(size_t);
+
+        start = (start + page_size - 1) & ~(uintptr_t)(page_size - 1);
+        end &= ~(uintptr_t)(page_size - 1);
+        if (start < end) {
+            system_calls_counters.count(MADVISE_CALL);
+            madvise((void*)start, end - start, MADV_DONTNEED);
+            released = true;
+        }
+    }
+
+    return released;
+}
+
+bool HeapBlocksList::ownsRegionAddress(void *addr) {
+    char* start = region_start.load(std::memory_order_acquire);
+
+    return start != NULL
+           && (char*)addr >= start
+           && (char*)addr < start + ARENA_REGION_SIZE;
+}
+
+bool HeapBlocksList::ownsHeapAddress(void *addr) {
+    if (!is_sbrk_heap) {
+        return ownsRegionAddress(addr);
+    }
+
+    // sbrk(0) makes no system call
+    char* start = heap_start.load(std::memory_order_acquire);
+    return start != NULL && (char*)addr >= start && addr < sbrk(0);
+}
+
+MallocMetadata* HeapBlocksList::getSuccBlock(MallocMetadata *block_metadata) {
+    if (block_metadata == tail) {
         return NULL;
     }
+    return block_metadata->getNextBlock();
+}
 
-    wilderness_block_metadata->size[TOTAL_PAYLOAD] = new_payload_size;
-    wilderness_block_metadata->size[ACTIVE_PAYLOAD] = new_payload_size;
+MallocMetadata* HeapBlocksList::getFreePredBlock(MallocMetadata *block_metadata) {
+    if (!block_metadata->hasFlag(PREV_FREE_FLAG)) {
+        return NULL;
+    }
+    return block_metadata->getPrevBlock();
+}
 
-    // blocks_count[TOTAL] doesn't change
-    // blocks_count[FREE] doesn't change
-    bytes_count[TOTAL] += extra_needed_size;
-    // bytes_count[FREE] doesn't change
+void HeapBlocksList::setSuccPrevFreeFlag(MallocMetadata *block_metadata,
+        bool is_free) {
+    MallocMetadata* succ_metadata = getSuccBlock(block_metadata);
+    if (succ_metadata == NULL) {
+        return;
+    }
 
-    return wilderness_block_metadata->getPayloadBlockAddr();
+    if (is_free) {
+        succ_metadata->setFlag(PREV_FREE_FLAG);
+    } else {
+        succ_metadata->clearFlag(PREV_FREE_FLAG);
+    }
 }
 
-bool HeapBlocksList::canReallocateUsingPredOrSucc(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    // here old block isn't large enough alone
-    // If old block is the wilderness block then we are here because enlarging it failed
+MallocMetadata* HeapBlocksList::findFreeBlock(size_t block_size) {
+    return fit_policy.findFreeBlock(*this, block_size);
+}
+
+MallocMetadata* HeapBlocksList::getNextFittingBlock(
+        MallocMetadata *block_metadata, size_t block_size) {
+    size_t bin_index;
+    MallocMetadata* curr_block_metadata;
+    if (block_metadata == NULL) {
+        bin_index = getFreeBinIndex(block_size);
+        curr_block_metadata = free_bins[bin_index];
+    } else {
+        bin_index = getFreeBinIndex(block_metadata->getBlockSize());
+        curr_block_metadata = block_metadata->nextFree();
+    }
+
+    for (;;) {
+        if (curr_block_metadata == NULL) {
+            bin_index = findNonEmptyFreeBin(bin_index + 1);
+            if (bin_index == FREE_BINS_COUNT) {
+                return NULL;
+            }
+            curr_block_metadata = free_bins[bin_index];
+        }
+
+        // blocks in the matching bin may still be smaller than block_size
+        if (curr_block_metadata->getBlockSize() >= block_size) {
+            return curr_block_metadata;
+        }
+        curr_block_metadata = curr_block_metadata->nextFree();
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+MallocMetadata* LifoFitPolicy::findFreeBlock(HeapBlocksList &heap,
+        size_t block_size) {
+    // bins are LIFO lists
+    return heap.getNextFittingBlock(NULL, block_size);
+}
+
+MallocMetadata* FirstFitPolicy::findFreeBlock(HeapBlocksList &heap,
+        size_t block_size) {
+    MallocMetadata* first_block_metadata = NULL;
+    for (MallocMetadata* block_metadata = heap.getNextFittingBlock(NULL,
+                                                                   block_size);
+         block_metadata != NULL;
+         block_metadata = heap.getNextFittingBlock(block_metadata, block_size)) {
+        if (first_block_metadata == NULL
+            || block_metadata < first_block_metadata) {
+            first_block_metadata = block_metadata;
+        }
+    }
+
+    return first_block_metadata;
+}
+
+MallocMetadata* NextFitPolicy::findFreeBlock(HeapBlocksList &heap,
+        size_t block_size) {
+    // the first block from the rover on, or else the first block of all
+    MallocMetadata* next_block_metadata = NULL;
+    MallocMetadata* first_block_metadata = NULL;
+    for (MallocMetadata* block_metadata = heap.getNextFittingBlock(NULL,
+                                                                   block_size);
+         block_metadata != NULL;
+         block_metadata = heap.getNextFittingBlock(block_metadata, block_size)) {
+        if ((char*)block_metadata >= rover
+            && (next_block_metadata == NULL
+                || block_metadata < next_block_metadata)) {
+            next_block_metadata = block_metadata;
+        }
+        if (first_block_metadata == NULL
+            || block_metadata < first_block_metadata) {
+            first_block_metadata = block_metadata;
+        }
+    }
+
+    if (next_block_metadata == NULL) {
+        next_block_metadata = first_block_metadata;
+    }
+    if (next_block_metadata != NULL) {
+        rover = (char*)next_block_metadata + block_size;
+    }
+    return next_block_metadata;
+}
+
+MallocMetadata* BestFitPolicy::findFreeBlock(HeapBlocksList &heap,
+        size_t block_size) {
+    MallocMetadata* best_block_metadata = NULL;
+    for (MallocMetadata* block_metadata = heap.getNextFittingBlock(NULL,
+                                                                   block_size);
+         block_metadata != NULL;
+         block_metadata = heap.getNextFittingBlock(block_metadata, block_size)) {
+        if (best_block_metadata != NULL
+            && HeapBlocksList::getFreeBinIndex(block_metadata->getBlockSize())
+               != HeapBlocksList::getFreeBinIndex(
+                       best_block_metadata->getBlockSize())) {
+            // blocks of the following bins are larger
+            break;
+        }
+        if (best_block_metadata == NULL
+            || block_metadata->getBlockSize()
+               < best_block_metadata->getBlockSize()) {
+            best_block_metadata = block_metadata;
+            if (block_metadata->getBlockSize() == block_size) {
+                break;
+            }
+        }
+    }
+
+    return best_block_metadata;
+}
+
+MallocMetadata* GoodFitPolicy::findFreeBlock(HeapBlocksList &heap,
+        size_t block_size) {
+    MallocMetadata* best_block_metadata = NULL;
+    MallocMetadata* block_metadata = heap.getNextFittingBlock(NULL, block_size);
+    for (size_t i = 0; i < GOOD_FIT_MAX_CANDIDATES && block_metadata != NULL;
+         i++) {
+        if (best_block_metadata == NULL
+            || block_metadata->getBlockSize()
+               < best_block_metadata->getBlockSize()) {
+            best_block_metadata = block_metadata;
+        }
+        block_metadata = heap.getNextFittingBlock(block_metadata, block_size);
+    }
+
+    return best_block_metadata;
+}
+
+// ----------------------------------------------------------------------------
+
+size_t HeapBlocksList::getFreeBinIndex(size_t block_size) {
+    if (block_size < SMALL_FREE_BINS_COUNT * SMALL_FREE_BIN_WIDTH) {
+        return block_size / SMALL_FREE_BIN_WIDTH;
+    }
+
+    // here block_size >= 256, so log2_size >= 8
+    size_t log2_size = BITMAP_WORD_BITS - 1 - __builtin_clzl(block_size);
+    size_t sub_bin = (block_size >> (log2_size - 2)) & 3;
+    size_t bin_index = SMALL_FREE_BINS_COUNT + (log2_size - 8) * 4 + sub_bin;
+
+    return min(bin_index, FREE_BINS_COUNT - 1);
+}
+
+size_t HeapBlocksList::findNonEmptyFreeBin(size_t first_bin_index) {
+    size_t word_index = first_bin_index / BITMAP_WORD_BITS;
+    if (word_index >= FREE_BINS_COUNT / BITMAP_WORD_BITS) {
+        return FREE_BINS_COUNT;
+    }
+
+    // ignore the bins before first_bin_index in the first word
+    uint64_t word = non_empty_free_bins[word_index]
+                    & (~(uint64_t)0 << (first_bin_index % BITMAP_WORD_BITS));
+
+    while (word == 0) {
+        word_index++;
+        if (word_index == FREE_BINS_COUNT / BITMAP_WORD_BITS) {
+            return FREE_BINS_COUNT;
+        }
+        word = non_empty_free_bins[word_index];
+    }
+
+    return word_index * BITMAP_WORD_BITS + __builtin_ctzl(word);
+}
+
+void HeapBlocksList::insertToFreeBin(MallocMetadata *block_metadata) {
+    size_t bin_index = getFreeBinIndex(block_metadata->getBlockSize());
+
+    block_metadata->prevFree() = NULL;
+    block_metadata->nextFree() = free_bins[bin_index];
+    if (free_bins[bin_index] != NULL) {
+        free_bins[bin_index]->prevFree() = block_metadata;
+    }
+    free_bins[bin_index] = block_metadata;
+
+    non_empty_free_bins[bin_index / BITMAP_WORD_BITS] |=
+            (uint64_t)1 << (bin_index % BITMAP_WORD_BITS);
+    countFreeBinBlock(block_metadata, true);
+}
+
+void HeapBlocksList::removeFromFreeBin(MallocMetadata *block_metadata) {
+    // must be called before the size of the block changes
+    size_t bin_index = getFreeBinIndex(block_metadata->getBlockSize());
+
+    if (block_metadata->nextFree() != NULL) {
+        block_metadata->nextFree()->prevFree() = block_metadata->prevFree();
+    }
+    if (block_metadata->prevFree() != NULL) {
+        block_metadata->prevFree()->nextFree() = block_metadata->nextFree();
+    } else {
+        free_bins[bin_index] = block_metadata->nextFree();
+    }
+
+    if (free_bins[bin_index] == NULL) {
+        non_empty_free_bins[bin_index / BITMAP_WORD_BITS] &=
+                ~((uint64_t)1 << (bin_index % BITMAP_WORD_BITS));
+    }
+    countFreeBinBlock(block_metadata, false);
+}
+
+void *HeapBlocksList::allocateBlock(size_t payload_size) {
+    size_t block_size = getBlockSizeForPayload(payload_size);
+    MallocMetadata* free_block_metadata = findFreeBlock(block_size);
+    void* payload_block_addr = NULL;
+
+    if (free_block_metadata == NULL && tail != NULL
+        && tail->hasFlag(FREE_FLAG)) {
+        // enlarge “Wilderness” block and use it
+        payload_block_addr = useWildernessBlock(block_size);
+    }
+    else if (free_block_metadata == NULL) {
+        // must allocate a new block
+        payload_block_addr = createNewBlock(block_size);
+    }
+    else {
+        // use free block and also do splitting if needed
+        payload_block_addr = useFreeBlock(free_block_metadata, block_size);
+    }
+
+    return payload_block_addr;
+}
+
+void* HeapBlocksList::allocateFreeBlock(size_t payload_size) {
+    size_t block_size = getBlockSizeForPayload(payload_size);
+    MallocMetadata* free_block_metadata = findFreeBlock(block_size);
+    if (free_block_metadata == NULL) {
+        return NULL;
+    }
+
+    return useFreeBlock(free_block_metadata, block_size);
+}
+
+void* HeapBlocksList::allocateAlignedBlock(size_t alignment,
+        size_t payload_size) {
+    // room for an aligned payload after a leading block
+    void* payload_addr = allocateBlock(payload_size + alignment + MIN_BLOCK_SIZE);
+    if (payload_addr == NULL) {
+        // sbrk() failed
+        return NULL;
+    }
+
+    auto* block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+
+    size_t leading_block_size = ((uintptr_t)-(uintptr_t)payload_addr)
+                                & (alignment - 1);
+    if (leading_block_size != 0 && leading_block_size < MIN_BLOCK_SIZE) {
+        // the leading block must be large enough to be on its own
+        leading_block_size += alignment;
+    }
+
+    if (leading_block_size != 0) {
+        auto* aligned_block_metadata = (MallocMetadata*)((char*)block_metadata
+                                                         + leading_block_size);
+        aligned_block_metadata->size_and_flags =
+                block_metadata->getBlockSize() - leading_block_size;
+        block_metadata->setBlockSize(leading_block_size);
+        if (tail == block_metadata) {
+            tail = aligned_block_metadata;
+        }
+
+        blocks_count[TOTAL]++;
+        // bytes_count[TOTAL] doesn't change
+        splits_count++;
+
+        freeBlock(block_metadata);
+        block_metadata = aligned_block_metadata;
+    }
+
+    splitUsedBlock(block_metadata, getBlockSizeForPayload(payload_size));
+
+    return block_metadata->getPayloadBlockAddr();
+}
+
+void *HeapBlocksList::createNewBlock(size_t block_size) {
+    void* top_addr = allocateFromTop(block_size);
+    if (top_addr == (void*)-1) {
+        // sbrk() failed
+        return NULL;
+    }
+
+    appendBlock(top_addr, block_size);
+
+    return tail->getPayloadBlockAddr();
+}
+
+void HeapBlocksList::appendBlock(void *block_addr, size_t block_size) {
+    auto* new_block_metadata = (MallocMetadata*)block_addr;
+    new_block_metadata->size_and_flags = block_size;
+
+    if (head == NULL) { // list empty
+        head = new_block_metadata;
+    } else if (tail->hasFlag(FREE_FLAG)) {
+        new_block_metadata->setFlag(PREV_FREE_FLAG);
+    }
+    tail = new_block_metadata;
+
+    blocks_count[TOTAL]++;
+    // blocks_count[FREE] doesn't change
+    bytes_count[TOTAL] += block_size;
+    // bytes_count[FREE] doesn't change
+}
+
+void *HeapBlocksList::useFreeBlock(MallocMetadata* free_block_metadata,
+        size_t block_size) {
+    removeFromFreeBin(free_block_metadata);
+    free_block_metadata->clearFlag(FREE_FLAG);
+    setSuccPrevFreeFlag(free_block_metadata, false);
+
+    // blocks_count[TOTAL] doesn't change
+    blocks_count[FREE]--;
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] -= free_block_metadata->getPayloadSize();
+
+    // split if the remaining part is large enough
+    splitUsedBlock(free_block_metadata, block_size);
+
+    return free_block_metadata->getPayloadBlockAddr();
+}
+
+void* HeapBlocksList::useWildernessBlock(size_t block_size) {
+    // here wilderness block is free but not large enough
+
+    MallocMetadata* wilderness_block_metadata = tail;
+
+    size_t extra_needed_size = block_size
+                               - wilderness_block_metadata->getBlockSize();
+
+    if (allocateFromTop(extra_needed_size) == (void*)-1) {
+        // sbrk() failed
+        return NULL;
+    }
+    if (tail != wilderness_block_metadata) {
+        // the top chunk started over after memory of others, see growTop()
+        top_start -= extra_needed_size;
+        top_size += extra_needed_size;
+        return createNewBlock(block_size);
+    }
+
+    removeFromFreeBin(wilderness_block_metadata);
+
+    // blocks_count[TOTAL] doesn't change
+    blocks_count[FREE]--;
+    bytes_count[TOTAL] += extra_needed_size;
+    bytes_count[FREE] -= wilderness_block_metadata->getPayloadSize();
+
+    wilderness_block_metadata->clearFlag(FREE_FLAG);
+    wilderness_block_metadata->setBlockSize(block_size);
+
+    return wilderness_block_metadata->getPayloadBlockAddr();
+}
+
+void HeapBlocksList::splitUsedBlock(MallocMetadata *block_metadata,
+        size_t block_size) {
+    size_t remaining_block_size = block_metadata->getBlockSize() - block_size;
+    if (remaining_block_size < sizeof(MallocMetadata) + SPLITTING_THRESHOLD) {
+        // remaining size to small, don't split
+        return;
+    }
+
+    block_metadata->setBlockSize(block_size);
+
+    MallocMetadata* remaining_block_metadata = block_metadata->getNextBlock();
+    remaining_block_metadata->size_and_flags = remaining_block_size;
+    if (tail == block_metadata) {
+        tail = remaining_block_metadata;
+    }
+
+    blocks_count[TOTAL]++;
+    // bytes_count[TOTAL] doesn't change
+    splits_count++;
+
+    // the remaining block may be merged with a free succ
+    freeBlock(remaining_block_metadata);
+}
+
+void HeapBlocksList::releaseUsedBlock(void *payload_addr) {
+    // here payload_addr != NULL
+
+    auto *block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+    if (block_metadata->hasFlag(FREE_FLAG)) {
+        // we allow double free
+        return;
+    }
+
+    block_metadata->setCached(false);
+    freeBlock(block_metadata);
+
+    // keep a chunk, so the heap doesn't grow and shrink on every call
+    size_t kept_size = max(top_pad, growth_size);
+    if (getFreeEndSize() > kept_size + trim_threshold) {
+        trimHeap(kept_size);
+    }
+}
+
+void HeapBlocksList::releaseUsedBlocks(void **payload_addrs,
+        size_t addrs_count) {
+    size_t i = 0;
+    while (i < addrs_count) {
+        auto* run_metadata = MallocMetadata::getBlockMetadata(payload_addrs[i]);
+        size_t run_block_size = run_metadata->getBlockSize();
+
+        MallocMetadata* last_block_metadata = run_metadata;
+        size_t run_blocks_count = 1;
+        for (i++; i < addrs_count; i++) {
+            auto* block_metadata =
+                    MallocMetadata::getBlockMetadata(payload_addrs[i]);
+            if ((char*)block_metadata != (char*)run_metadata + run_block_size) {
+                break;
+            }
+            run_block_size += block_metadata->getBlockSize();
+            last_block_metadata = block_metadata;
+            run_blocks_count++;
+        }
+
+        if (run_blocks_count > 1) {
+            // the blocks after the first are used, so their flags are clear
+            run_metadata->setBlockSize(run_block_size);
+            if (tail == last_block_metadata) {
+                tail = run_metadata;
+            }
+
+            blocks_count[TOTAL] -= run_blocks_count - 1;
+            // blocks_count[FREE] doesn't change
+            // bytes_count[TOTAL] doesn't change
+            // bytes_count[FREE] doesn't change
+            coalesces_count += run_blocks_count - 1;
+        }
+
+        releaseUsedBlock(run_metadata->getPayloadBlockAddr());
+    }
+}
+
+void HeapBlocksList::freeBlock(MallocMetadata *block_metadata) {
+    MallocMetadata* succ_metadata = getSuccBlock(block_metadata);
+
+    bool combine_with_succ = succ_metadata != NULL
+                             && succ_metadata->hasFlag(FREE_FLAG);
+
+    bool combine_with_pred = block_metadata->hasFlag(PREV_FREE_FLAG);
+
+    if (combine_with_succ && combine_with_pred) {
+        combineFreeBlockWithSuccAndPred(block_metadata);
+    }
+    else if (combine_with_succ) {
+        combineFreeBlockWithSucc(block_metadata);
+    }
+    else if (combine_with_pred) {
+        combineFreeBlockWithPred(block_metadata);
+    }
+    else {
+        freeBlockWithoutCombining(block_metadata);
+    }
+}
+
+void HeapBlocksList::combineFreeBlockWithSucc(MallocMetadata *block_metadata) {
+    // here succ exists and is free
+
+    MallocMetadata* succ_metadata = block_metadata->getNextBlock();
+    removeFromFreeBin(succ_metadata);
+
+    if (tail == succ_metadata) {
+        tail = block_metadata;
+    }
+
+    blocks_count[TOTAL]--;
+    // blocks_count[FREE] doesn't change
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] += block_metadata->getBlockSize();
+    coalesces_count++;
+
+    // the block after succ already has PREV_FREE_FLAG on
+    block_metadata->setFlag(FREE_FLAG);
+    block_metadata->setBlockSize(block_metadata->getBlockSize()
+                                 + succ_metadata->getBlockSize());
+    block_metadata->writeFooter();
+    insertToFreeBin(block_metadata);
+}
+
+void HeapBlocksList::combineFreeBlockWithPred(MallocMetadata *block_metadata) {
+    // here pred exists and is free
+    MallocMetadata* pred_metadata = block_metadata->getPrevBlock();
+    removeFromFreeBin(pred_metadata);
+
+    setSuccPrevFreeFlag(block_metadata, true);
+    if (tail == block_metadata) {
+        tail = pred_metadata;
+    }
+
+    pred_metadata->setBlockSize(pred_metadata->getBlockSize()
+                                + block_metadata->getBlockSize());
+    pred_metadata->writeFooter();
+    insertToFreeBin(pred_metadata);
+
+    blocks_count[TOTAL]--;
+    // blocks_count[FREE] doesn't change
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] += block_metadata->getBlockSize();
+    coalesces_count++;
+}
+
+void HeapBlocksList::combineFreeBlockWithSuccAndPred(MallocMetadata *block_metadata) {
+    // here pred and succ exist and are free
+    MallocMetadata* pred_metadata = block_metadata->getPrevBlock();
+    MallocMetadata* succ_metadata = block_metadata->getNextBlock();
+    removeFromFreeBin(pred_metadata);
+    removeFromFreeBin(succ_metadata);
+
+    if (tail == succ_metadata) {
+        tail = pred_metadata;
+    }
+
+    // the block after succ already has PREV_FREE_FLAG on
+    pred_metadata->setBlockSize(pred_metadata->getBlockSize()
+                                + block_metadata->getBlockSize()
+                                + succ_metadata->getBlockSize());
+    pred_metadata->writeFooter();
+    insertToFreeBin(pred_metadata);
+
+    blocks_count[TOTAL] -= 2;
+    blocks_count[FREE]--;
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] += block_metadata->getBlockSize() + sizeof(MallocMetadata);
+    coalesces_count += 2;
+}
+
+void HeapBlocksList::freeBlockWithoutCombining(MallocMetadata* block_metadata) {
+    block_metadata->setFlag(FREE_FLAG);
+    block_metadata->writeFooter();
+    setSuccPrevFreeFlag(block_metadata, true);
+    insertToFreeBin(block_metadata);
+
+    // blocks_count[TOTAL] doesn't change
+    blocks_count[FREE]++;
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] += block_metadata->getPayloadSize();
+}
+
+void *HeapBlocksList::allocateZeroedBlock(size_t payload_size) {
+    // the top chunk is cut from its start, so only space below it was used
+    char* used_end = top_start;
+    void* payload_block_addr = allocateBlock(payload_size);
+    // the first growth of the heap sets the zero mark
+    if (top_zero_start > used_end) {
+        used_end = top_zero_start;
+    }
+
+    if (payload_block_addr != NULL && (char*)payload_block_addr < used_end) {
+        // zeroing only the part of block the user asked for that was used
+        memset(payload_block_addr, 0,
+               min(payload_size, used_end - (char*)payload_block_addr));
+    }
+
+    return payload_block_addr;
+}
+
+size_t HeapBlocksList::allocateBlocks(size_t payload_size, size_t addrs_count,
+        void** payload_addrs) {
+    // here 0 < addrs_count
+    size_t block_size = getBlockSizeForPayload(payload_size);
+    void* run_payload_addr = allocateBlock(block_size * addrs_count
+                                           - sizeof(MallocMetadata));
+    if (run_payload_addr == NULL) {
+        // no room for all of them in one piece, try one by one
+        size_t allocated_count = 0;
+        while (allocated_count < addrs_count) {
+            void* payload_addr = allocateBlock(payload_size);
+            if (payload_addr == NULL) {
+                break;
+            }
+            payload_addrs[allocated_count++] = payload_addr;
+        }
+        return allocated_count;
+    }
+
+    auto* block_metadata = MallocMetadata::getBlockMetadata(run_payload_addr);
+    size_t run_block_size = block_metadata->getBlockSize();
+    bool is_run_tail = block_metadata == tail;
+
+    block_metadata->setBlockSize(block_size);
+    payload_addrs[0] = run_payload_addr;
+    for (size_t i = 1; i < addrs_count; i++) {
+        block_metadata = (MallocMetadata*)((char*)block_metadata + block_size);
+        block_metadata->size_and_flags = block_size;
+        payload_addrs[i] = block_metadata->getPayloadBlockAddr();
+    }
+    // a free block too small to split leaves some more bytes to the last one
+    block_metadata->setBlockSize(run_block_size
+                                 - (addrs_count - 1) * block_size);
+    if (is_run_tail) {
+        tail = block_metadata;
+    }
+
+    blocks_count[TOTAL] += addrs_count - 1;
+    // blocks_count[FREE] doesn't change
+    // bytes_count[TOTAL] doesn't change
+    // bytes_count[FREE] doesn't change
+    splits_count += addrs_count - 1;
+
+    return addrs_count;
+}
+
+void *HeapBlocksList::reallocateActiveBlock(void *old_payload_addr,
+        size_t new_payload_size) {
+
+    if (old_payload_addr == NULL) {
+        // act like a call to smalloc(new_payload_size)
+        return allocateBlock(new_payload_size);
+    }
+
+    auto *old_block_metadata = MallocMetadata::getBlockMetadata(old_payload_addr);
+    size_t block_size = getBlockSizeForPayload(new_payload_size);
+
+    if (old_block_metadata->getBlockSize() >= block_size) {
+        // current block is large enough
+        return reallocateWithSameBlock(old_block_metadata, block_size);
+    }
+    if (tail == old_block_metadata
+        && reallocateWildernessBlock(block_size) != NULL) {
+        // enlarge and use Wilderness block.
+        // if sbrk() fails continue to other options
+        return old_payload_addr;
+    }
+    if (canReallocateUsingPredOrSucc(old_block_metadata, block_size)) {
+        return reallocateUsingPredOrSucc(old_block_metadata, block_size);
+    }
+
+    // otherwise, try to find a different block
+    return reallocateToOtherBlock(old_block_metadata, old_payload_addr,
+            new_payload_size);
+}
+
+void* HeapBlocksList::reallocateWithSameBlock(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    splitUsedBlock(old_block_metadata, block_size);
+
+    return old_block_metadata->getPayloadBlockAddr();
+}
+
+void *HeapBlocksList::reallocateWildernessBlock(size_t block_size) {
+    // here Wilderness block is used but not large enough
+    MallocMetadata* wilderness_block_metadata = tail;
+
+    size_t extra_needed_size = block_size
+                               - wilderness_block_metadata->getBlockSize();
+
+    if (allocateFromTop(extra_needed_size) == (void*)-1) {
+        // sbrk() failed
+        return NULL;
+    }
+    if (tail != wilderness_block_metadata) {
+        // the top chunk started over after memory of others, see growTop()
+        top_start -= extra_needed_size;
+        top_size += extra_needed_size;
+        return NULL;
+    }
+
+    wilderness_block_metadata->setBlockSize(block_size);
+
+    // blocks_count[TOTAL] doesn't change
+    // blocks_count[FREE] doesn't change
+    bytes_count[TOTAL] += extra_needed_size;
+    // bytes_count[FREE] doesn't change
+
+    return wilderness_block_metadata->getPayloadBlockAddr();
+}
+
+bool HeapBlocksList::canReallocateUsingPredOrSucc(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    // here old block isn't large enough alone
+    // If old block is the wilderness block then we are here because enlarging it failed
+
+    return canReallocateUsingPredOnly(old_block_metadata, block_size)
+        || canReallocateUsingSuccOnly(old_block_metadata, block_size)
+        || canReallocateUsingPredAndSucc(old_block_metadata, block_size);
+}
+
+bool HeapBlocksList::canReallocateUsingPredOnly(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    MallocMetadata* pred_metadata = getFreePredBlock(old_block_metadata);
+    if (pred_metadata == NULL) {
+        return false;
+    }
+
+    size_t total_avail_size = pred_metadata->getBlockSize()
+                              + old_block_metadata->getBlockSize();
+
+    return total_avail_size >= block_size;
+}
+
+bool HeapBlocksList::canReallocateUsingSuccOnly(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    MallocMetadata* succ_metadata = getSuccBlock(old_block_metadata);
+    if (succ_metadata == NULL || !succ_metadata->hasFlag(FREE_FLAG)) {
+        return false;
+    }
+
+    size_t total_avail_size = old_block_metadata->getBlockSize()
+                              + succ_metadata->getBlockSize();
+
+    return total_avail_size >= block_size;
+}
+
+bool HeapBlocksList::canReallocateUsingPredAndSucc(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    MallocMetadata* pred_metadata = getFreePredBlock(old_block_metadata);
+    MallocMetadata* succ_metadata = getSuccBlock(old_block_metadata);
+    if (pred_metadata == NULL || succ_metadata == NULL
+        || !succ_metadata->hasFlag(FREE_FLAG)) {
+        return false;
+    }
+
+    size_t total_avail_size = pred_metadata->getBlockSize()
+                              + old_block_metadata->getBlockSize()
+                              + succ_metadata->getBlockSize();
+
+    return total_avail_size >= block_size;
+}
+
+void* HeapBlocksList::reallocateUsingPredOrSucc(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    // here we can reallocate using pred and/or succ
+
+    // try using pred only
+    if (canReallocateUsingPredOnly(old_block_metadata, block_size)) {
+        return reallocateUsingPredOnly(old_block_metadata, block_size);
+    }
+
+    // if pred not large enough, try using succ only
+    if (canReallocateUsingSuccOnly(old_block_metadata, block_size)) {
+        return reallocateUsingSuccOnly(old_block_metadata, block_size);
+    }
+
+    // if succ alone not large enough, use both pred and succ
+    // it is promised here that pred and succ combined are large enough
+    return reallocateUsingPredAndSucc(old_block_metadata, block_size);
+}
+
+void* HeapBlocksList::reallocateUsingPredOnly(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    // here pred exists, free and large enough
+
+    MallocMetadata* pred_metadata = old_block_metadata->getPrevBlock();
+    size_t old_payload_size = old_block_metadata->getPayloadSize();
+
+    removeFromFreeBin(pred_metadata);
+    if (tail == old_block_metadata) {
+        tail = pred_metadata;
+    }
+
+    blocks_count[TOTAL]--;
+    blocks_count[FREE]--;
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] -= pred_metadata->getPayloadSize();
+    coalesces_count++;
+
+    // the block after old block already has PREV_FREE_FLAG off
+    pred_metadata->clearFlag(FREE_FLAG);
+    pred_metadata->setBlockSize(pred_metadata->getBlockSize()
+                                + old_block_metadata->getBlockSize());
+
+    /* move the data before the remaining block is carved, because the
+     * metadata of the remaining block may lie inside the old payload */
+    memmove(pred_metadata->getPayloadBlockAddr(),
+            old_block_metadata->getPayloadBlockAddr(),
+            old_payload_size);
+
+    splitUsedBlock(pred_metadata, block_size);
+
+    return pred_metadata->getPayloadBlockAddr();
+}
+
+void* HeapBlocksList::reallocateUsingSuccOnly(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    // here succ exists, free and large enough
+
+    MallocMetadata* succ_metadata = old_block_metadata->getNextBlock();
+
+    removeFromFreeBin(succ_metadata);
+    if (tail == succ_metadata) {
+        tail = old_block_metadata;
+    }
+
+    blocks_count[TOTAL]--;
+    blocks_count[FREE]--;
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] -= succ_metadata->getPayloadSize();
+    coalesces_count++;
+
+    old_block_metadata->setBlockSize(old_block_metadata->getBlockSize()
+                                     + succ_metadata->getBlockSize());
+    setSuccPrevFreeFlag(old_block_metadata, false);
+
+    // no memmove needed
+    splitUsedBlock(old_block_metadata, block_size);
+
+    return old_block_metadata->getPayloadBlockAddr();
+}
+
+void *HeapBlocksList::reallocateUsingPredAndSucc(MallocMetadata *old_block_metadata,
+        size_t block_size) {
+    // here pred and succ exists, free and large enough
+
+    MallocMetadata* pred_metadata = old_block_metadata->getPrevBlock();
+    MallocMetadata* succ_metadata = old_block_metadata->getNextBlock();
+    size_t old_payload_size = old_block_metadata->getPayloadSize();
+
+    removeFromFreeBin(pred_metadata);
+    removeFromFreeBin(succ_metadata);
+    if (tail == succ_metadata) {
+        tail = pred_metadata;
+    }
+
+    blocks_count[TOTAL] -= 2;
+    blocks_count[FREE] -= 2;
+    // bytes_count[TOTAL] doesn't change
+    bytes_count[FREE] -= pred_metadata->getPayloadSize()
+                         + succ_metadata->getPayloadSize();
+    coalesces_count += 2;
+
+    pred_metadata->clearFlag(FREE_FLAG);
+    pred_metadata->setBlockSize(pred_metadata->getBlockSize()
+                                + old_block_metadata->getBlockSize()
+                                + succ_metadata->getBlockSize());
+    setSuccPrevFreeFlag(pred_metadata, false);
+
+    // as in reallocateUsingPredOnly, move the data before carving
+    memmove(pred_metadata->getPayloadBlockAddr(),
+            old_block_metadata->getPayloadBlockAddr(),
+            old_payload_size);
+
+    splitUsedBlock(pred_metadata, block_size);
+
+    return pred_metadata->getPayloadBlockAddr();
+}
+
+void *HeapBlocksList::reallocateToOtherBlock(MallocMetadata *old_block_metadata,
+        void* old_payload_addr, size_t new_payload_size) {
+
+    void* new_payload_block_addr = allocateBlock(new_payload_size);
+    if (new_payload_block_addr == NULL) {
+        // sbrk() failed
+        return NULL;
+    }
+
+    memmove(new_payload_block_addr,
+            old_payload_addr,
+            old_block_metadata->getPayloadSize());
+    releaseUsedBlock(old_payload_addr);
+
+    return new_payload_block_addr;
+}
+
+// ----------------------------------------------------------------------------
+
+/* blocks of at least this many bytes are mmapped, at first. The threshold
+ * rises to the size of mmapped blocks freed within SHORT_LIVED_BLOCK_MS of
+ * their allocation, as their mmap() and page faults are repeated for every
+ * allocation, while the heap reuses its memory */
+const size_t MMAP_THRESHOLD = SMALLOC_MMAP_THRESHOLD;
+const size_t DEFAULT_MMAP_THRESHOLD_MAX = 32 * 1024 * KB;
+// larger heap blocks could take up much of an arena's region
+const size_t MMAP_THRESHOLD_LIMIT = ARENA_REGION_SIZE / 4;
+const uint64_t SHORT_LIVED_BLOCK_MS = 1000;
+
+/* released mappings are kept for reuse, so a program that keeps allocating
+ * and releasing large buffers doesn't pay for mmap(), munmap() and page
+ * faults every time. The cache has a byte budget, and mappings that were not
+ * reused for MMAP_CACHE_MAX_AGE_MS are unmapped on the next call */
+const size_t DEFAULT_MMAP_CACHE_MAX_BYTES = 32 * 1024 * KB;
+const uint64_t MMAP_CACHE_MAX_AGE_MS = 2000;
+
+uint64_t getMonotonicTimeMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* lives in the payload of a cached block, whose metadata stays valid with
+ * FREE_FLAG on, so releasing it again is detected */
+class CachedMapping {
+public:
+    // in the cache bin of its size
+    CachedMapping *next_in_bin, *prev_in_bin;
+    // in the list of all cached mappings, newest first
+    CachedMapping *newer, *older;
+    uint64_t release_time_ms;
+
+    MallocMetadata* getBlockMetadata();
+};
+
+MallocMetadata* CachedMapping::getBlockMetadata() {
+    return MallocMetadata::getBlockMetadata(this);
+}
+
+class MMappedBlocksManager{
+public:
+    size_t total_blocks_count;
+    // payload only, the rest of the mappings is metadata
+    size_t total_bytes_count;
+
+    // cached mappings are binned by size like free heap blocks
+    CachedMapping* cache_bins[FREE_BINS_COUNT];
+    CachedMapping *newest_cached_mapping, *oldest_cached_mapping;
+    size_t cached_bytes_count;
+    size_t cache_max_bytes;
+
+    HugePagesMode huge_pages_mode;
+    size_t hugetlb_bytes_count;
+
+    // used blocks, for smalloc_stats()
+    size_t used_blocks_by_size_class[SMALLOC_STATS_SIZE_CLASSES_COUNT];
+
+    constexpr MMappedBlocksManager();
+
+    void* allocateBlock(size_t payload_size);
+
+    void* allocateZeroedBlock(size_t payload_size);
+
+    // reuse a cached mapping. NULL if none fits
+    void* allocateCachedBlock(size_t payload_size);
+
+    // return false if the mapping can't be cached and must be unmapped
+    bool cacheMapping(MallocMetadata* block_metadata);
+
+    void removeCachedMapping(CachedMapping* cached_mapping);
+
+    // unmap the cached mappings released at least @max_age_ms ago
+    void releaseExpiredMappings(uint64_t max_age_ms);
+
+    // unmap the oldest cached mappings until the cache is within budget
+    void releaseMappingsOverBudget();
+
+    void releaseCachedMapping(CachedMapping* cached_mapping);
+
+    void setCacheMaxBytes(size_t max_bytes);
+
+    void addToStats(SmallocStats& stats);
+
+    // @alignment is a power of 2
+    void* allocateAlignedBlock(size_t alignment, size_t payload_size);
+
+    void* createNewBlock(size_t alignment, size_t payload_size);
+
+    // NULL if there are no free hugetlbfs pages
+    void* createHugeTLBBlock(size_t alignment, size_t payload_size);
+
+    void releaseUsedBlock(void* payload_addr);
+
+    void* reallocateActiveBlock(void* old_payload_addr,
+            size_t new_payload_size);
+};
+
+// ----------------------------------------------------------------------------
+
+constexpr MMappedBlocksManager::MMappedBlocksManager()
+        : total_blocks_count(0), total_bytes_count(0), cache_bins(),
+          newest_cached_mapping(NULL), oldest_cached_mapping(NULL),
+          cached_bytes_count(0), cache_max_bytes(DEFAULT_MMAP_CACHE_MAX_BYTES),
+          huge_pages_mode(HUGE_PAGES_NONE), hugetlb_bytes_count(0),
+          used_blocks_by_size_class()
+{
+}
+
+void *MMappedBlocksManager::allocateBlock(size_t payload_size) {
+    void* payload_addr = allocateCachedBlock(payload_size);
+    if (payload_addr != NULL) {
+        return payload_addr;
+    }
+
+    return createNewBlock(BLOCK_SIZE_ALIGNMENT, payload_size);
+}
+
+void *MMappedBlocksManager::allocateZeroedBlock(size_t payload_size) {
+    void* payload_addr = allocateCachedBlock(payload_size);
+    if (payload_addr != NULL) {
+        // cached mappings were already used
+        memset(payload_addr, 0, payload_size);
+        return payload_addr;
+    }
+
+    // new mappings are zeroed by the kernel
+    return createNewBlock(BLOCK_SIZE_ALIGNMENT, payload_size);
+}
+
+void *MMappedBlocksManager::allocateCachedBlock(size_t payload_size) {
+    if (oldest_cached_mapping == NULL) {
+        return NULL;
+    }
+    releaseExpiredMappings(MMAP_CACHE_MAX_AGE_MS);
+
+    size_t page_size = getpagesize();
+    size_t mapping_size = (MMAPPED_BLOCK_PREFIX_SIZE + payload_size
+                           + page_size - 1) / page_size * page_size;
+
+    // mappings in the matching bin may be smaller, in the next bin they aren't
+    size_t bin_index = HeapBlocksList::getFreeBinIndex(mapping_size);
+    CachedMapping* cached_mapping = cache_bins[bin_index];
+    while (cached_mapping != NULL
+           && cached_mapping->getBlockMetadata()->getBlockSize() < mapping_size) {
+        cached_mapping = cached_mapping->next_in_bin;
+    }
+    if (cached_mapping == NULL && bin_index + 1 < FREE_BINS_COUNT) {
+        cached_mapping = cache_bins[bin_index + 1];
+    }
+    if (cached_mapping == NULL) {
+        return NULL;
+    }
+
+    removeCachedMapping(cached_mapping);
+
+    MallocMetadata* block_metadata = cached_mapping->getBlockMetadata();
+    block_metadata->clearFlag(FREE_FLAG);
+    block_metadata->setMMappedAllocationTimeMs(getMonotonicTimeMs());
+
+    total_blocks_count++;
+    total_bytes_count += block_metadata->getPayloadSize();
+    used_blocks_by_size_class[
+            getStatsSizeClass(block_metadata->getPayloadSize())]++;
+
+    return block_metadata->getPayloadBlockAddr();
+}
+
+bool MMappedBlocksManager::cacheMapping(MallocMetadata *block_metadata) {
+    size_t mapping_size = block_metadata->getBlockSize();
+
+    /* aligned blocks don't start at the start of their mapping, and hugetlbfs
+     * pages are better returned to their pool */
+    if (block_metadata->getMMappedPrefixSize() != MMAPPED_BLOCK_PREFIX_SIZE
+        || block_metadata->hasFlag(HUGETLB_FLAG)
+        || mapping_size > cache_max_bytes / 4) {
+        return false;
+    }
+
+    block_metadata->setFlag(FREE_FLAG);
+
+    auto* cached_mapping = (CachedMapping*)block_metadata->getPayloadBlockAddr();
+    cached_mapping->release_time_ms = getMonotonicTimeMs();
+
+    size_t bin_index = HeapBlocksList::getFreeBinIndex(mapping_size);
+    cached_mapping->prev_in_bin = NULL;
+    cached_mapping->next_in_bin = cache_bins[bin_index];
+    if (cache_bins[bin_index] != NULL) {
+        cache_bins[bin_index]->prev_in_bin = cached_mapping;
+    }
+    cache_bins[bin_index] = cached_mapping;
+
+    cached_mapping->newer = NULL;
+    cached_mapping->older = newest_cached_mapping;
+    if (newest_cached_mapping != NULL) {
+        newest_cached_mapping->newer = cached_mapping;
+    } else {
+        oldest_cached_mapping = cached_mapping;
+    }
+    newest_cached_mapping = cached_mapping;
+
+    cached_bytes_count += mapping_size;
+    releaseMappingsOverBudget();
+
+    return true;
+}
+
+void MMappedBlocksManager::removeCachedMapping(CachedMapping *cached_mapping) {
+    size_t mapping_size = cached_mapping->getBlockMetadata()->getBlockSize();
+
+    if (cached_mapping->next_in_bin != NULL) {
+        cached_mapping->next_in_bin->prev_in_bin = cached_mapping->prev_in_bin;
+    }
+    if (cached_mapping->prev_in_bin != NULL) {
+        cached_mapping->prev_in_bin->next_in_bin = cached_mapping->next_in_bin;
+    } else {
+        cache_bins[HeapBlocksList::getFreeBinIndex(mapping_size)] =
+                cached_mapping->next_in_bin;
+    }
+
+    if (cached_mapping->older != NULL) {
+        cached_mapping->older->newer = cached_mapping->newer;
+    } else {
+        oldest_cached_mapping = cached_mapping->newer;
+    }
+    if (cached_mapping->newer != NULL) {
+        cached_mapping->newer->older = cached_mapping->older;
+    } else {
+        newest_cached_mapping = cached_mapping->older;
+    }
+
+    cached_bytes_count -= mapping_size;
+}
+
+void MMappedBlocksManager::releaseExpiredMappings(uint64_t max_age_ms) {
+    if (oldest_cached_mapping == NULL) {
+        return;
+    }
+
+    uint64_t now_ms = getMonotonicTimeMs();
+    while (oldest_cached_mapping != NULL
+           && now_ms - oldest_cached_mapping->release_time_ms >= max_age_ms) {
+        releaseCachedMapping(oldest_cached_mapping);
+    }
+}
+
+void MMappedBlocksManager::releaseMappingsOverBudget() {
+    while (cached_bytes_count > cache_max_bytes) {
+        releaseCachedMapping(oldest_cached_mapping);
+    }
+}
+
+void MMappedBlocksManager::releaseCachedMapping(CachedMapping *cached_mapping) {
+    removeCachedMapping(cached_mapping);
+
+    // cleared before unmapping, when the page may be mapped again
+    page_map.set(cached_mapping, PAGE_UNKNOWN);
+
+    MallocMetadata* block_metadata = cached_mapping->getBlockMetadata();
+    system_calls_counters.count(MUNMAP_CALL);
+    munmap((char*)cached_mapping - MMAPPED_BLOCK_PREFIX_SIZE,
+           block_metadata->getBlockSize());
+}
+
+void MMappedBlocksManager::setCacheMaxBytes(size_t max_bytes) {
+    cache_max_bytes = max_bytes;
+    releaseMappingsOverBudget();
+}
+
+void MMappedBlocksManager::addToStats(SmallocStats &stats) {
+    stats.mmapped.used_blocks += total_blocks_count;
+    stats.mmapped.used_bytes += total_bytes_count;
+    for (size_t i = 0; i < SMALLOC_STATS_SIZE_CLASSES_COUNT; i++) {
+        stats.used_blocks_by_size_class[i] += used_blocks_by_size_class[i];
+    }
+
+    for (CachedMapping* cached_mapping = newest_cached_mapping;
+         cached_mapping != NULL; cached_mapping = cached_mapping->older) {
+        size_t payload_size = cached_mapping->getBlockMetadata()
+                                            ->getPayloadSize();
+        stats.mmapped.free_blocks++;
+        stats.mmapped.free_bytes += payload_size;
+        stats.free_blocks_by_size_class[getStatsSizeClass(payload_size)]++;
+    }
+}
+
+void *MMappedBlocksManager::allocateAlignedBlock(size_t alignment,
+        size_t payload_size) {
+    return createNewBlock(alignment, payload_size);
+}
+
+void *MMappedBlocksManager::createNewBlock(size_t alignment,
+        size_t payload_size) {
+    bool use_huge_pages = huge_pages_mode != HUGE_PAGES_NONE
+            && MMAPPED_BLOCK_PREFIX_SIZE + payload_size >= HUGE_PAGE_SIZE;
+
+    if (use_huge_pages && huge_pages_mode == HUGE_PAGES_HUGETLB) {
+        void* payload_addr = createHugeTLBBlock(alignment, payload_size);
+        if (payload_addr != NULL) {
+            return payload_addr;
+        }
+        // no free hugetlbfs pages, fall back to transparent huge pages
+    }
+
+    /* the block is made of whole units, huge pages or pages. Map extra space
+     * to find an aligned unit and an aligned payload in, and give it back
+     * after */
+    size_t page_size = getpagesize();
+    size_t unit_size = use_huge_pages ? HUGE_PAGE_SIZE : page_size;
+    size_t extra_size = alignment > BLOCK_SIZE_ALIGNMENT ? alignment : 0;
+    size_t mapping_size = (MMAPPED_BLOCK_PREFIX_SIZE + payload_size + extra_size
+                           + unit_size - 1) / unit_size * unit_size
+                          + (unit_size - page_size);
+
+    system_calls_counters.count(MMAP_CALL);
+    void* mapping_addr = mmap(NULL, mapping_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS,
+                              -1,
+                              0);
+    if (mapping_addr == (void*)-1) {
+        // mmap failed
+        return NULL;
+    }
+
+    char* mapping_end = (char*)mapping_addr + mapping_size;
+    uintptr_t first_unit = ((uintptr_t)mapping_addr + unit_size - 1)
+                           & ~(uintptr_t)(unit_size - 1);
+    char* payload_addr = (char*)((first_unit + MMAPPED_BLOCK_PREFIX_SIZE
+                                  + alignment - 1)
+                                 & ~(uintptr_t)(alignment - 1));
+    char* block_start = (char*)(((uintptr_t)payload_addr
+                                 - MMAPPED_BLOCK_PREFIX_SIZE)
+                                & ~(uintptr_t)(unit_size - 1));
+    char* block_end = (char*)(((uintptr_t)payload_addr + payload_size
+                               + unit_size - 1)
+                              & ~(uintptr_t)(unit_size - 1));
+
+    // unmap the whole pages around the block
+    if (block_start != (char*)mapping_addr) {
+        system_calls_counters.count(MUNMAP_CALL);
+        munmap(mapping_addr, block_start - (char*)mapping_addr);
+    }
+    if (block_end != mapping_end) {
+        system_calls_counters.count(MUNMAP_CALL);
+        munmap(block_end, mapping_end - block_end);
+    }
+
+    if (use_huge_pages) {
+        system_calls_counters.count(MADVISE_CALL);
+        madvise(block_start, block_end - block_start, MADV_HUGEPAGE);
+    }
+
+    // see MemoryManager::ownsBlock()
+    if (!page_map.set(payload_addr, PAGE_MMAPPED_BLOCK)) {
+        system_calls_counters.count(MUNMAP_CALL);
+        munmap(block_start, block_end - block_start);
+        return NULL;
+    }
+
+    auto* metadata_addr = MallocMetadata::getBlockMetadata(payload_addr);
+    metadata_addr->size_and_flags = (block_end - block_start) | MMAPPED_FLAG;
+    metadata_addr->setMMappedPrefixSize(payload_addr - block_start);
+    metadata_addr->setMMappedAllocationTimeMs(getMonotonicTimeMs());
+
+    total_blocks_count++;
+    total_bytes_count += metadata_addr->getPayloadSize();
+    used_blocks_by_size_class[
+            getStatsSizeClass(metadata_addr->getPayloadSize())]++;
+
+    return payload_addr;
+}
+
+void *MMappedBlocksManager::createHugeTLBBlock(size_t alignment,
+        size_t payload_size) {
+    if (alignment > HUGE_PAGE_SIZE) {
+        return NULL;
+    }
+
+    // hugetlbfs mappings are huge page aligned
+    size_t extra_size = alignment > BLOCK_SIZE_ALIGNMENT ? alignment : 0;
+    size_t mapping_size = (MMAPPED_BLOCK_PREFIX_SIZE + payload_size + extra_size
+                           + HUGE_PAGE_SIZE - 1)
+                          / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+    system_calls_counters.count(MMAP_CALL);
+    void* mapping_addr = mmap(NULL, mapping_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                              -1,
+                              0);
+    if (mapping_addr == (void*)-1) {
+        return NULL;
+    }
+
+    char* payload_addr = (char*)(((uintptr_t)mapping_addr
+                                  + MMAPPED_BLOCK_PREFIX_SIZE + alignment - 1)
+                                 & ~(uintptr_t)(alignment - 1));
+
+    if (!page_map.set(payload_addr, PAGE_MMAPPED_BLOCK)) {
+        system_calls_counters.count(MUNMAP_CALL);
+        munmap(mapping_addr, mapping_size);
+        return NULL;
+    }
+
+    auto* metadata_addr = MallocMetadata::getBlockMetadata(payload_addr);
+    metadata_addr->size_and_flags = mapping_size | MMAPPED_FLAG | HUGETLB_FLAG;
+    metadata_addr->setMMappedPrefixSize(payload_addr - (char*)mapping_addr);
+    metadata_addr->setMMappedAllocationTimeMs(getMonotonicTimeMs());
+
+    total_blocks_count++;
+    total_bytes_count += metadata_addr->getPayloadSize();
+    used_blocks_by_size_class[
+            getStatsSizeClass(metadata_addr->getPayloadSize())]++;
+    hugetlb_bytes_count += mapping_size;
+
+    return payload_addr;
+}
+
+void MMappedBlocksManager::releaseUsedBlock(void *payload_addr) {
+    // here payload_addr != NULL
+
+    auto* block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+
+    total_blocks_count--;
+    total_bytes_count -= block_metadata->getPayloadSize();
+    used_blocks_by_size_class[
+            getStatsSizeClass(block_metadata->getPayloadSize())]--;
+    if (block_metadata->hasFlag(HUGETLB_FLAG)) {
+        hugetlb_bytes_count -= block_metadata->getBlockSize();
+    }
+
+    releaseExpiredMappings(MMAP_CACHE_MAX_AGE_MS);
+    if (cacheMapping(block_metadata)) {
+        return;
+    }
+
+    page_map.set(payload_addr, PAGE_UNKNOWN);
+    system_calls_counters.count(MUNMAP_CALL);
+    munmap((char*)payload_addr - block_metadata->getMMappedPrefixSize(),
+           block_metadata->getBlockSize());
+}
+
+void *MMappedBlocksManager::reallocateActiveBlock(void *old_payload_addr,
+        size_t new_payload_size) {
+    if (old_payload_addr == NULL) {
+        // act like a call to smalloc(new_payload_size)
+        return allocateBlock(new_payload_size);
+    }
+
+    auto* block_metadata = MallocMetadata::getBlockMetadata(old_payload_addr);
+    size_t prefix_size = block_metadata->getMMappedPrefixSize();
+    size_t old_mapping_size = block_metadata->getBlockSize();
+
+    bool is_hugetlb = block_metadata->hasFlag(HUGETLB_FLAG);
+    size_t page_size = is_hugetlb ? HUGE_PAGE_SIZE : getpagesize();
+    size_t new_mapping_size = (prefix_size + new_payload_size + page_size - 1)
+                              / page_size * page_size;
+
+    if (new_mapping_size == old_mapping_size) {
+        // same number of pages, nothing to do
+        return old_payload_addr;
+    }
+
+    if (is_hugetlb) {
+        // hugetlbfs mappings can't be remapped, copy to a new block
+        void* new_payload_addr = allocateBlock(new_payload_size);
+        if (new_payload_addr != NULL) {
+            memmove(new_payload_addr, old_payload_addr,
+                    min(new_payload_size, block_metadata->getPayloadSize()));
+            releaseUsedBlock(old_payload_addr);
+        }
+        return new_payload_addr;
+    }
+
+    /* grows in place if the pages after the mapping are free, otherwise the
+     * kernel moves the page tables instead of copying the payload */
+    page_map.set(old_payload_addr, PAGE_UNKNOWN);
+    system_calls_counters.count(MREMAP_CALL);
+    void* new_mapping_addr = mremap((char*)old_payload_addr - prefix_size,
+                                    old_mapping_size, new_mapping_size,
+                                    MREMAP_MAYMOVE);
+    if (new_mapping_addr == MAP_FAILED) {
+        // mremap failed, the old block is untouched
+        page_map.set(old_payload_addr, PAGE_MMAPPED_BLOCK);
+        return NULL;
+    }
+
+    char* new_payload_addr = (char*)new_mapping_addr + prefix_size;
+    /* the leaf of the old page is mapped already. A new one failing to map
+     * only makes MemoryManager::ownsBlock() disown the block */
+    page_map.set(new_payload_addr, PAGE_MMAPPED_BLOCK);
+    block_metadata = MallocMetadata::getBlockMetadata(new_payload_addr);
+
+    // total_blocks_count doesn't change
+    total_bytes_count -= block_metadata->getPayloadSize();
+    used_blocks_by_size_class[
+            getStatsSizeClass(block_metadata->getPayloadSize())]--;
+    block_metadata->setBlockSize(new_mapping_size);
+    total_bytes_count += block_metadata->getPayloadSize();
+    used_blocks_by_size_class[
+            getStatsSizeClass(block_metadata->getPayloadSize())]++;
+
+    return new_payload_addr;
+}
+
+// ----------------------------------------------------------------------------
+
+class Lock {
+public:
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    void acquire();
+
+    void release();
+};
+
+void Lock::acquire() {
+    pthread_mutex_lock(&mutex);
+}
+
+void Lock::release() {
+    pthread_mutex_unlock(&mutex);
+}
+
+// holds a lock for the lifetime of the guard
+class LockGuard {
+public:
+    Lock& lock;
+
+    explicit LockGuard(Lock& lock);
+
+    ~LockGuard();
+};
+
+LockGuard::LockGuard(Lock &lock)
+        : lock(lock)
+{
+    lock.acquire();
+}
+
+LockGuard::~LockGuard() {
+    lock.release();
+}
+
+// ----------------------------------------------------------------------------
+
+const size_t MAX_ARENAS_COUNT = 64;
+static_assert(PAGE_HEAP + MAX_ARENAS_COUNT <= 256,
+              "the arena of a heap page must fit in its page map entry");
+
+/* an independent heap with its own lock. Threads are spread over the arenas,
+ * and blocks always return to the arena they were allocated from */
+class alignas(64) Arena {
+public:
+    Lock lock;
+    HeapBlocksList heap_blocks_list;
+    /* blocks freed by threads of other arenas, chained through nextFree().
+     * Pushed without the lock, and released by the arena's own threads */
+    std::atomic<MallocMetadata*> remote_freed_blocks{NULL};
+
+    // like in glibc, the main arena is the one that uses sbrk()
+    constexpr Arena(bool is_main_arena = false);
+
+    // release a chain of used blocks linked through nextFree(). Lock held
+    void releaseBlocks(MallocMetadata* first_block_metadata);
+
+    // push a chain of cached blocks linked through nextFree() with one CAS
+    void pushRemoteFreedBlocks(MallocMetadata* first_block_metadata,
+            MallocMetadata* last_block_metadata);
+
+    // lock held
+    void releaseRemoteFreedBlocks();
+};
+
+constexpr Arena::Arena(bool is_main_arena)
+        : heap_blocks_list(is_main_arena)
+{
+}
+
+void Arena::releaseBlocks(MallocMetadata *first_block_metadata) {
+    while (first_block_metadata != NULL) {
+        MallocMetadata* next_block_metadata = first_block_metadata->nextFree();
+        heap_blocks_list.releaseUsedBlock(
+                first_block_metadata->getPayloadBlockAddr());
+        first_block_metadata = next_block_metadata;
+    }
+}
+
+void Arena::pushRemoteFreedBlocks(MallocMetadata *first_block_metadata,
+        MallocMetadata *last_block_metadata) {
+    MallocMetadata* head_block_metadata =
+            remote_freed_blocks.load(std::memory_order_relaxed);
+
+    do {
+        last_block_metadata->nextFree() = head_block_metadata;
+    } while (!remote_freed_blocks.compare_exchange_weak(head_block_metadata,
+            first_block_metadata,
+            std::memory_order_release, std::memory_order_relaxed));
+}
+
+void Arena::releaseRemoteFreedBlocks() {
+    if (remote_freed_blocks.load(std::memory_order_relaxed) == NULL) {
+        return;
+    }
+
+    // the whole queue is taken at once, so there is no ABA problem
+    releaseBlocks(remote_freed_blocks.exchange(NULL, std::memory_order_acquire));
+}
+
+// ----------------------------------------------------------------------------
+
+/* small objects live in slabs, page sized blocks carved into equal slots
+ * without any per slot metadata. A slab is found from a slot address by
+ * masking, and a bitmap in its header marks the used slots */
+const size_t SLAB_SIZE = 4 * KB;
+const size_t SLAB_SLOT_SIZE_STEP = 16;
+const size_t SLAB_CLASSES_COUNT = 8;
+const size_t SLAB_MAX_PAYLOAD_SIZE = SLAB_CLASSES_COUNT * SLAB_SLOT_SIZE_STEP;
+const size_t SLAB_MAX_SLOTS_COUNT = 256;
+// virtual address space reserved for all the slabs
+const size_t SLAB_REGION_SIZE = (size_t)4 * 1024 * 1024 * KB;
+// number of slabs made accessible at once when the region grows
+const size_t SLAB_REGION_GROWTH_SLABS_COUNT = 16;
+
+class Slab {
+public:
+    Slab *next, *prev; // in the partial slabs list of its class
+    uint32_t slot_size;
+    uint32_t slots_count;
+    uint32_t used_slots_count;
+    uint64_t used_slots[SLAB_MAX_SLOTS_COUNT / BITMAP_WORD_BITS];
+    /* used slots that are in a thread cache. Thread caches mark them without
+     * the class lock, so the words are changed atomically */
+    std::atomic<uint64_t> cached_slots[SLAB_MAX_SLOTS_COUNT / BITMAP_WORD_BITS];
+
+    void init(size_t new_slot_size);
+
+    void* getSlotAddr(size_t slot_index);
+
+    // return SLAB_MAX_SLOTS_COUNT if @slot_addr isn't the start of a slot
+    size_t getSlotIndex(void* slot_addr);
+
+    // here the slab isn't full
+    void* allocateSlot();
+
+    // return false if the slot isn't used. We allow double free
+    bool releaseSlot(void* slot_addr);
+
+    /* mark the slot at @slot_addr as cached. Return false if it already is,
+     * or isn't the start of a slot */
+    bool setSlotCached(void* slot_addr);
+
+    void clearSlotCached(void* slot_addr);
+};
+
+const size_t SLAB_HEADER_SIZE =
+        (sizeof(Slab) + SLAB_SLOT_SIZE_STEP - 1)
+        / SLAB_SLOT_SIZE_STEP * SLAB_SLOT_SIZE_STEP;
+
+// all the slabs with the same slot size
+class alignas(64) SlabClass {
+public:
+    Lock lock;
+    // slabs with at least one unused slot
+    Slab* partial_slabs = NULL;
+    size_t slabs_count = 0;
+    size_t used_slots_count = 0;
+};
+
+class SlabAllocator {
+public:
+    SlabClass classes[SLAB_CLASSES_COUNT];
+
+    // guards the region and the empty slabs
+    Lock region_lock;
+    std::atomic<char*> region_start;
+    char *region_break, *region_accessible_end;
+    Slab* empty_slabs;
+
+    constexpr SlabAllocator();
+
+    static size_t getClassIndex(size_t payload_size);
+
+    static Slab* getSlab(void* slot_addr);
+
+    bool ownsAddress(void* addr);
+
+    /* allocate up to @slots_count slots of class @class_index under one lock
+     * and chain them through their first word. Return the chain */
+    void* allocateSlots(size_t class_index, size_t slots_count);
+
+    // release a chain of slots of class @class_index linked through their first word
+    void releaseSlots(size_t class_index, void* first_slot_addr);
+
+    // class lock held
+    Slab* createSlab(SlabClass& slab_class, size_t class_index);
+
+    // class lock held
+    void releaseEmptySlab(SlabClass& slab_class, Slab* slab);
+
+    void insertPartialSlab(SlabClass& slab_class, Slab* slab);
+
+    void removePartialSlab(SlabClass& slab_class, Slab* slab);
+
+    // takes the lock of every class
+    void addToStats(SmallocStats& stats);
+};
+
+// ----------------------------------------------------------------------------
+
+void Slab::init(size_t new_slot_size) {
+    next = NULL;
+    prev = NULL;
+    slot_size = new_slot_size;
+    slots_count = min((SLAB_SIZE - SLAB_HEADER_SIZE) / new_slot_size,
+                      SLAB_MAX_SLOTS_COUNT);
+    used_slots_count = 0;
+    memset(used_slots, 0, sizeof(used_slots));
+    for (size_t i = 0; i < SLAB_MAX_SLOTS_COUNT / BITMAP_WORD_BITS; i++) {
+        cached_slots[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void* Slab::getSlotAddr(size_t slot_index) {
+    return (char*)this + SLAB_HEADER_SIZE + slot_index * slot_size;
+}
+
+size_t Slab::getSlotIndex(void *slot_addr) {
+    size_t offset = (char*)slot_addr - (char*)this;
+    if (offset < SLAB_HEADER_SIZE
+        || (offset - SLAB_HEADER_SIZE) % slot_size != 0
+        || (offset - SLAB_HEADER_SIZE) / slot_size >= slots_count) {
+        return SLAB_MAX_SLOTS_COUNT;
+    }
+
+    return (offset - SLAB_HEADER_SIZE) / slot_size;
+}
+
+void* Slab::allocateSlot() {
+    size_t word_index = 0;
+    while (used_slots[word_index] == ~(uint64_t)0) {
+        word_index++;
+    }
+
+    size_t slot_index = word_index * BITMAP_WORD_BITS
+                        + __builtin_ctzl(~used_slots[word_index]);
+    used_slots[word_index] |= (uint64_t)1 << (slot_index % BITMAP_WORD_BITS);
+    used_slots_count++;
+
+    return getSlotAddr(slot_index);
+}
+
+bool Slab::releaseSlot(void *slot_addr) {
+    size_t slot_index = getSlotIndex(slot_addr);
+    if (slot_index == SLAB_MAX_SLOTS_COUNT) {
+        return false;
+    }
+
+    uint64_t slot_bit = (uint64_t)1 << (slot_index % BITMAP_WORD_BITS);
+    if ((used_slots[slot_index / BITMAP_WORD_BITS] & slot_bit) == 0) {
+        return false;
+    }
+
+    used_slots[slot_index / BITMAP_WORD_BITS] &= ~slot_bit;
+    used_slots_count--;
+    cached_slots[slot_index / BITMAP_WORD_BITS].fetch_and(~slot_bit,
+            std::memory_order_relaxed);
+
+    return true;
+}
+
+bool Slab::setSlotCached(void *slot_addr) {
+    size_t slot_index = getSlotIndex(slot_addr);
+    if (slot_index == SLAB_MAX_SLOTS_COUNT) {
+        return false;
+    }
+
+    uint64_t slot_bit = (uint64_t)1 << (slot_index % BITMAP_WORD_BITS);
+    return (cached_slots[slot_index / BITMAP_WORD_BITS].fetch_or(slot_bit,
+            std::memory_order_relaxed) & slot_bit) == 0;
+}
+
+void Slab::clearSlotCached(void *slot_addr) {
+    // here slot_addr is the start of a cached slot
+    size_t slot_index = ((char*)slot_addr - (char*)this - SLAB_HEADER_SIZE)
+                        / slot_size;
+    uint64_t slot_bit = (uint64_t)1 << (slot_index % BITMAP_WORD_BITS);
+    cached_slots[slot_index / BITMAP_WORD_BITS].fetch_and(~slot_bit,
+            std::memory_order_relaxed);
+}
+
+constexpr SlabAllocator::SlabAllocator()
+        : classes(), region_start(NULL), region_break(NULL),
+          region_accessible_end(NULL), empty_slabs(NULL)
+{
+}
+
+size_t SlabAllocator::getClassIndex(size_t payload_size) {
+    // here 0 < payload_size <= SLAB_MAX_PAYLOAD_SIZE
+    return (payload_size - 1) / SLAB_SLOT_SIZE_STEP;
+}
+
+Slab* SlabAllocator::getSlab(void *slot_addr) {
+    return (Slab*)((uintptr_t)slot_addr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+bool SlabAllocator::ownsAddress(void *addr) {
+    char* start = region_start.load(std::memory_order_acquire);
+
+    return start != NULL
+           && (char*)addr >= start
+           && (char*)addr < start + SLAB_REGION_SIZE;
+}
+
+void* SlabAllocator::allocateSlots(size_t class_index, size_t slots_count) {
+    SlabClass& slab_class = classes[class_index];
+    void* allocated_slots = NULL;
+
+    LockGuard guard(slab_class.lock);
+    for (size_t i = 0; i < slots_count; i++) {
+        Slab* slab = slab_class.partial_slabs;
+        if (slab == NULL) {
+            slab = createSlab(slab_class, class_index);
+            if (slab == NULL) {
+                // out of memory, return what we have
+                break;
+            }
+        }
+
+        void* slot_addr = slab->allocateSlot();
+        if (slab->used_slots_count == slab->slots_count) {
+            removePartialSlab(slab_class, slab);
+        }
+        slab_class.used_slots_count++;
+
+        *(void**)slot_addr = allocated_slots;
+        allocated_slots = slot_addr;
+    }
+
+    return allocated_slots;
+}
+
+void SlabAllocator::releaseSlots(size_t class_index, void *first_slot_addr) {
+    SlabClass& slab_class = classes[class_index];
+
+    LockGuard guard(slab_class.lock);
+    while (first_slot_addr != NULL) {
+        void* next_slot_addr = *(void**)first_slot_addr;
+        Slab* slab = getSlab(first_slot_addr);
+
+        bool was_full = slab->used_slots_count == slab->slots_count;
+        if (slab->releaseSlot(first_slot_addr)) {
+            slab_class.used_slots_count--;
+            if (was_full) {
+                insertPartialSlab(slab_class, slab);
+            }
+            if (slab->used_slots_count == 0) {
+                releaseEmptySlab(slab_class, slab);
+            }
+        }
+
+        first_slot_addr = next_slot_addr;
+    }
+}
+
+Slab* SlabAllocator::createSlab(SlabClass &slab_class, size_t class_index) {
+    Slab* slab = NULL;
+
+    {
+        LockGuard guard(region_lock);
+
+        if (empty_slabs != NULL) {
+            slab = empty_slabs;
+            empty_slabs = slab->next;
+        } else {
+            if (region_start == NULL) {
+                system_calls_counters.count(MMAP_CALL);
+                void* region_addr = mmap(NULL, SLAB_REGION_SIZE, PROT_NONE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                         -1, 0);
+                if (region_addr == MAP_FAILED) {
+                    return NULL;
+                }
+                region_break = (char*)region_addr;
+                region_accessible_end = (char*)region_addr;
+                region_start.store((char*)region_addr, std::memory_order_release);
+            }
+
+            if (region_break == region_accessible_end) {
+                size_t growth_size = SLAB_REGION_GROWTH_SLABS_COUNT * SLAB_SIZE;
+                if (region_accessible_end + growth_size
+                    > region_start + SLAB_REGION_SIZE) {
+                    return NULL;
+                }
+                system_calls_counters.count(MPROTECT_CALL);
+                if (mprotect(region_accessible_end, growth_size,
+                             PROT_READ | PROT_WRITE) != 0) {
+                    return NULL;
+                }
+                region_accessible_end += growth_size;
+            }
+
+            slab = (Slab*)region_break;
+            region_break += SLAB_SIZE;
+        }
+    }
+
+    slab->init((class_index + 1) * SLAB_SLOT_SIZE_STEP);
+    insertPartialSlab(slab_class, slab);
+    slab_class.slabs_count++;
+
+    return slab;
+}
+
+void SlabAllocator::releaseEmptySlab(SlabClass &slab_class, Slab *slab) {
+    /* keep the last partial slab of the class, so a single object isn't
+     * bouncing a slab in and out of the class */
+    if (slab_class.partial_slabs == slab && slab->next == NULL) {
+        return;
+    }
+
+    removePartialSlab(slab_class, slab);
+    slab_class.slabs_count--;
+
+    LockGuard guard(region_lock);
+    slab->next = empty_slabs;
+    empty_slabs = slab;
+}
+
+void SlabAllocator::insertPartialSlab(SlabClass &slab_class, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = slab_class.partial_slabs;
+    if (slab_class.partial_slabs != NULL) {
+        slab_class.partial_slabs->prev = slab;
+    }
+    slab_class.partial_slabs = slab;
+}
+
+void SlabAllocator::removePartialSlab(SlabClass &slab_class, Slab *slab) {
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        slab_class.partial_slabs = slab->next;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+void SlabAllocator::addToStats(SmallocStats &stats) {
+    for (size_t i = 0; i < SLAB_CLASSES_COUNT; i++) {
+        SlabClass& slab_class = classes[i];
+        size_t slot_size = (i + 1) * SLAB_SLOT_SIZE_STEP;
+        size_t slab_slots_count = min((SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size,
+                                      SLAB_MAX_SLOTS_COUNT);
+
+        LockGuard guard(slab_class.lock);
+        size_t free_slots_count = slab_class.slabs_count * slab_slots_count
+                                  - slab_class.used_slots_count;
+
+        stats.slab.used_blocks += slab_class.used_slots_count;
+        stats.slab.used_bytes += slab_class.used_slots_count * slot_size;
+        stats.slab.free_blocks += free_slots_count;
+        stats.slab.free_bytes += free_slots_count * slot_size;
+        stats.used_blocks_by_size_class[getStatsSizeClass(slot_size)] +=
+                slab_class.used_slots_count;
+        stats.free_blocks_by_size_class[getStatsSizeClass(slot_size)] +=
+                free_slots_count;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+/* per thread cache of recently freed small heap blocks and slab slots, so a
+ * common smalloc/sfree pair doesn't touch shared state. Bin i holds blocks
+ * whose payload is at least i * THREAD_CACHE_BIN_WIDTH bytes. Cached blocks
+ * stay used from the heap's point of view; they are chained through
+ * nextFree() and marked by CACHED_FLAG. Cached slots are
+ * chained through their first word and marked in the cached_slots bitmap of
+ * their slab */
+const size_t THREAD_CACHE_BIN_WIDTH = 16;
+const size_t THREAD_CACHE_BINS_COUNT = 65;
+const size_t THREAD_CACHE_MAX_PAYLOAD_SIZE =
+        (THREAD_CACHE_BINS_COUNT - 1) * THREAD_CACHE_BIN_WIDTH;
+const size_t THREAD_CACHE_BIN_CAPACITY = 32;
+// number of blocks moved between a cache bin and the heap at once
+const size_t THREAD_CACHE_BATCH_SIZE = 16;
+
+/* must stay trivially constructible, so each thread gets a zeroed instance
+ * without any registration */
+class ThreadCache {
+public:
+    MallocMetadata* bins[THREAD_CACHE_BINS_COUNT];
+    size_t bins_count[THREAD_CACHE_BINS_COUNT];
+    void* slab_bins[SLAB_CLASSES_COUNT];
+    size_t slab_bins_count[SLAB_CLASSES_COUNT];
+    bool is_registered;
+    // arena the thread allocates from, assigned on first use
+    Arena* arena;
+
+    void* allocateBlock(size_t payload_size);
+
+    // here 0 < payload_size <= SLAB_MAX_PAYLOAD_SIZE
+    void* allocateSlabSlot(size_t payload_size);
+
+    // here @slot_addr is in the slab region
+    void cacheSlabSlot(void* slot_addr);
+
+    void pushSlabSlot(size_t class_index, void* slot_addr);
+
+    void* popSlabSlot(size_t class_index);
+
+    void refillSlabBin(size_t class_index);
+
+    void flushSlabBin(size_t class_index, size_t slots_to_flush);
+
+    // return false if the block can't be cached and must be released
+    bool cacheBlock(MallocMetadata* block_metadata);
+
+    void pushBlock(size_t bin_index, MallocMetadata* block_metadata);
+
+    MallocMetadata* popBlock(size_t bin_index);
+
+    void refillBin(size_t bin_index);
+
+    void flushBin(size_t bin_index, size_t blocks_to_flush);
+
+    void flushAll();
+
+    // make sure the cache is flushed when the thread exits
+    void registerThread();
+};
+
+// ----------------------------------------------------------------------------
+
+class MemoryManager {
+public:
+    Arena arenas[MAX_ARENAS_COUNT];
+    // 0 until set by smallopt() or until the first thread gets an arena
+    std::atomic<size_t> arenas_count;
+    std::atomic<size_t> next_arena_index;
+
+    Lock mmapped_blocks_lock;
+    MMappedBlocksManager mmapped_blocks;
+
+    // see MMAP_THRESHOLD
+    std::atomic<size_t> mmap_threshold;
+    std::atomic<size_t> mmap_threshold_max;
+    // off once M_MMAP_THRESHOLD was set
+    std::atomic<bool> is_mmap_threshold_dynamic;
+    // the trim threshold rises along with it until M_TRIM_THRESHOLD is set
+    std::atomic<bool> is_trim_threshold_set;
+
+    SlabAllocator slab_allocator;
+
+    pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+    pthread_key_t thread_cache_key;
+
+    /* constant initialized, so the allocator works before any constructor
+     * runs, as when it is preloaded and called by the dynamic linker */
+    constexpr MemoryManager();
+
+    void* allocateBlock(size_t payload_size);
+
+    // @alignment is a power of 2
+    void* allocateAlignedBlock(size_t alignment, size_t payload_size);
+
+    void* allocateZeroedBlock(size_t payload_size);
+
+    void releaseUsedBlock(void* payload_addr);
+
+    // return the number of blocks allocated into @payload_addrs
+    size_t allocateBlocks(size_t payload_size, size_t blocks_count,
+            void** payload_addrs);
+
+    /* @payload_addrs is sorted. The heap blocks of the thread's arena are
+     * released under one lock, the others one by one */
+    void releaseUsedBlocks(void** payload_addrs, size_t blocks_count);
+
+    // @payload_size is the size the block was requested with
+    void releaseSizedBlock(void* payload_addr, size_t payload_size);
+
+    // here @payload_addr isn't of a slab slot
+    void releaseBlockWithMetaData(void* payload_addr);
+
+#ifdef SMALLOC_DEBUG
+    // abort if @payload_size is larger than the block at @payload_addr
+    void checkBlockSize(void* payload_addr, size_t payload_size);
+#endif
+
+    void* reallocateActiveBlock(void* old_payload_addr, size_t new_payload_size);
+
+    // move a block between the heap and the mmap tiers
+    void* reallocateToOtherTier(void* old_payload_addr, size_t new_payload_size);
+
+    void* reallocateSlabSlot(void* old_slot_addr, size_t new_payload_size);
+
+    /* allocate up to @blocks_count heap blocks with payload @payload_size
+     * under one lock and chain them through nextFree(). Return the chain */
+    MallocMetadata* allocateCachedBlocks(size_t payload_size,
+            size_t blocks_count);
+
+    // release a chain of cached blocks linked through nextFree()
+    void releaseCachedBlocks(MallocMetadata* first_block_metadata);
+
+    // arenas are assigned to threads round robin
+    Arena* getThreadArena();
+
+    // @block_metadata is of a heap block
+    Arena* findOwnerArena(MallocMetadata* block_metadata);
+
+    /* the arena whose heap pages hold @page_entry. With SMALLOC_DEBUG abort
+     * if it isn't PAGE_HEAP plus an arena index */
+    Arena* getPageArena(uint8_t page_entry);
+
+    /* whether @payload_addr is in memory of the allocator, found without
+     * reading the memory. For callers that may get pointers of others */
+    bool ownsBlock(void* payload_addr);
+
+    /* at least the size the block at @payload_addr was allocated with,
+     * including the spare bytes of heap blocks and the page rounding of
+     * mmapped blocks */
+    size_t getUsableSize(void* payload_addr);
+
+    // take every lock, in the order they nest in
+    void lockAll();
+
+    void unlockAll();
+
+    bool setArenasCount(size_t count);
+
+    bool setTrimThreshold(int threshold);
+
+    /* raise the mmap threshold above the size of an mmapped block of
+     * @block_size bytes that was just freed, if it was short lived */
+    void adaptMMapThreshold(size_t block_size, uint64_t allocation_time_ms);
+
+    bool setMMapThreshold(SmalloptParam param, int threshold);
+
+    bool setMMapCacheMaxBytes(int max_bytes);
+
+    // the other bound is moved if needed to keep min <= max
+    bool setHeapGrowthSize(SmalloptParam param, int size);
+
+    bool setHugePagesMode(int mode);
+
+    bool setHeapHugePages(int use_huge_pages);
+
+    size_t getHugePageBytesCount();
+
+    void getStats(SmallocStats& stats);
+
+    void getFragmentation(SmallocFragmentation& fragmentation);
+
+    // reserve in the heap of the calling thread's arena
+    bool reserveHeap(size_t size);
+
+    // return true if any memory was released
+    bool trimHeaps(size_t pad);
+
+    size_t getBlocksCount(BytesType type);
+
+    size_t getBytesCount(BytesType type);
+
+    /* the metadata of every block: getMetaDataSize() for heap blocks,
+     * MMAPPED_BLOCK_PREFIX_SIZE for mmapped ones and none for slab slots */
+    size_t getMetaDataBytesCount();
+
+    size_t getMetaDataSize();
+};
+
+constexpr MemoryManager::MemoryManager()
+        : arenas{{true}}, arenas_count(0), next_arena_index(0),
+          mmap_threshold(MMAP_THRESHOLD),
+          mmap_threshold_max(DEFAULT_MMAP_THRESHOLD_MAX),
+          is_mmap_threshold_dynamic(true), is_trim_threshold_set(false),
+          thread_cache_key()
+{
+}
+
+MemoryManager memory_manager;
+
+uint8_t getHeapPageEntry(HeapBlocksList *heap_blocks_list) {
+    size_t arena_index = 0;
+    while (&memory_manager.arenas[arena_index].heap_blocks_list
+           != heap_blocks_list) {
+        arena_index++;
+    }
+
+    return PAGE_HEAP + arena_index;
+}
+
+/* initial-exec, so that in a preloaded shared library thread locals are
+ * reached without __tls_get_addr(), which may call malloc() */
+__thread ThreadCache thread_cache __attribute__((tls_model("initial-exec")));
+
+// ----------------------------------------------------------------------------
+
+void* ThreadCache::allocateBlock(size_t payload_size) {
+    // here 0 < payload_size <= THREAD_CACHE_MAX_PAYLOAD_SIZE
+    size_t bin_index = (payload_size + THREAD_CACHE_BIN_WIDTH - 1)
+                       / THREAD_CACHE_BIN_WIDTH;
+
+    if (bins[bin_index] == NULL) {
+        refillBin(bin_index);
+        if (bins[bin_index] == NULL) {
+            // sbrk() failed
+            return NULL;
+        }
+    }
+
+    MallocMetadata* block_metadata = popBlock(bin_index);
+    block_metadata->setCached(false);
+
+    return block_metadata->getPayloadBlockAddr();
+}
+
+bool ThreadCache::cacheBlock(MallocMetadata *block_metadata) {
+    // here block_metadata is of a used heap block
+    size_t bin_index = block_metadata->getPayloadSize()
+                       / THREAD_CACHE_BIN_WIDTH;
+
+    if (bin_index == 0 || bin_index >= THREAD_CACHE_BINS_COUNT) {
+        return false;
+    }
+
+    registerThread();
+    if (bins_count[bin_index] == THREAD_CACHE_BIN_CAPACITY) {
+        flushBin(bin_index, THREAD_CACHE_BATCH_SIZE);
+    }
+
+    block_metadata->setCached(true);
+    pushBlock(bin_index, block_metadata);
+
+    return true;
+}
+
+void ThreadCache::pushBlock(size_t bin_index, MallocMetadata *block_metadata) {
+    block_metadata->nextFree() = bins[bin_index];
+    bins[bin_index] = block_metadata;
+    bins_count[bin_index]++;
+}
+
+MallocMetadata* ThreadCache::popBlock(size_t bin_index) {
+    // here bins[bin_index] != NULL
+    MallocMetadata* block_metadata = bins[bin_index];
+
+    bins[bin_index] = block_metadata->nextFree();
+    bins_count[bin_index]--;
+
+    return block_metadata;
+}
+
+void ThreadCache::refillBin(size_t bin_index) {
+    registerThread();
+
+    MallocMetadata* block_metadata = memory_manager.allocateCachedBlocks(
+            bin_index * THREAD_CACHE_BIN_WIDTH, THREAD_CACHE_BATCH_SIZE);
+
+    while (block_metadata != NULL) {
+        MallocMetadata* next_block_metadata = block_metadata->nextFree();
+        pushBlock(bin_index, block_metadata);
+        block_metadata = next_block_metadata;
+    }
+}
+
+void ThreadCache::flushBin(size_t bin_index, size_t blocks_to_flush) {
+    MallocMetadata* flushed_blocks = NULL;
+
+    for (size_t i = 0; i < blocks_to_flush && bins[bin_index] != NULL; i++) {
+        MallocMetadata* block_metadata = popBlock(bin_index);
+        block_metadata->nextFree() = flushed_blocks;
+        flushed_blocks = block_metadata;
+    }
+
+    memory_manager.releaseCachedBlocks(flushed_blocks);
+}
+
+void* ThreadCache::allocateSlabSlot(size_t payload_size) {
+    size_t class_index = SlabAllocator::getClassIndex(payload_size);
+
+    if (slab_bins[class_index] == NULL) {
+        refillSlabBin(class_index);
+        if (slab_bins[class_index] == NULL) {
+            // out of memory
+            return NULL;
+        }
+    }
+
+    void* slot_addr = popSlabSlot(class_index);
+    SlabAllocator::getSlab(slot_addr)->clearSlotCached(slot_addr);
+
+    return slot_addr;
+}
+
+void ThreadCache::cacheSlabSlot(void *slot_addr) {
+    Slab* slab = SlabAllocator::getSlab(slot_addr);
+    if (!slab->setSlotCached(slot_addr)) {
+        // slot is already in a thread cache. We allow double free
+        return;
+    }
+
+    size_t class_index = SlabAllocator::getClassIndex(slab->slot_size);
+
+    registerThread();
+    if (slab_bins_count[class_index] == THREAD_CACHE_BIN_CAPACITY) {
+        flushSlabBin(class_index, THREAD_CACHE_BATCH_SIZE);
+    }
+
+    pushSlabSlot(class_index, slot_addr);
+}
+
+void ThreadCache::pushSlabSlot(size_t class_index, void *slot_addr) {
+    ((void**)slot_addr)[0] = slab_bins[class_index];
+    slab_bins[class_index] = slot_addr;
+    slab_bins_count[class_index]++;
+}
+
+void* ThreadCache::popSlabSlot(size_t class_index) {
+    // here slab_bins[class_index] != NULL
+    void* slot_addr = slab_bins[class_index];
+
+    slab_bins[class_index] = ((void**)slot_addr)[0];
+    slab_bins_count[class_index]--;
+
+    return slot_addr;
+}
+
+void ThreadCache::refillSlabBin(size_t class_index) {
+    registerThread();
+
+    void* slot_addr = memory_manager.slab_allocator.allocateSlots(class_index,
+            THREAD_CACHE_BATCH_SIZE);
+
+    while (slot_addr != NULL) {
+        void* next_slot_addr = ((void**)slot_addr)[0];
+        SlabAllocator::getSlab(slot_addr)->setSlotCached(slot_addr);
+        pushSlabSlot(class_index, slot_addr);
+        slot_addr = next_slot_addr;
+    }
+}
+
+void ThreadCache::flushSlabBin(size_t class_index, size_t slots_to_flush) {
+    void* flushed_slots = NULL;
+
+    for (size_t i = 0; i < slots_to_flush && slab_bins[class_index] != NULL; i++) {
+        void* slot_addr = popSlabSlot(class_index);
+        ((void**)slot_addr)[0] = flushed_slots;
+        flushed_slots = slot_addr;
+    }
+
+    if (flushed_slots != NULL) {
+        memory_manager.slab_allocator.releaseSlots(class_index, flushed_slots);
+    }
+}
+
+void ThreadCache::flushAll() {
+    for (size_t i = 0; i < THREAD_CACHE_BINS_COUNT; i++) {
+        flushBin(i, bins_count[i]);
+    }
+    for (size_t i = 0; i < SLAB_CLASSES_COUNT; i++) {
+        flushSlabBin(i, slab_bins_count[i]);
+    }
+}
+
+void flushThreadCacheOnExit(void* cache) {
+    ((ThreadCache*)cache)->flushAll();
+    // destructors of other keys may still allocate and free
+    ((ThreadCache*)cache)->is_registered = false;
+}
+
+void createThreadCacheKey() {
+    pthread_key_create(&memory_manager.thread_cache_key,
+            flushThreadCacheOnExit);
+}
+
+void ThreadCache::registerThread() {
+    if (is_registered) {
+        return;
+    }
+
+    pthread_once(&memory_manager.thread_cache_key_once, createThreadCacheKey);
+    pthread_setspecific(memory_manager.thread_cache_key, this);
+    is_registered = true;
+}
+
+// ----------------------------------------------------------------------------
+
+void *MemoryManager::allocateBlock(size_t payload_size) {
+    if (SMALLOC_SLABS && payload_size <= SLAB_MAX_PAYLOAD_SIZE) {
+        return thread_cache.allocateSlabSlot(payload_size);
+    }
+    if (payload_size <= THREAD_CACHE_MAX_PAYLOAD_SIZE) {
+        return thread_cache.allocateBlock(payload_size);
+    }
+
+    if (payload_size >= mmap_threshold.load(std::memory_order_relaxed)) {
+        LockGuard guard(mmapped_blocks_lock);
+        return mmapped_blocks.allocateBlock(payload_size);
+    }
+
+    Arena* arena = getThreadArena();
+    LockGuard guard(arena->lock);
+    arena->releaseRemoteFreedBlocks();
+    return arena->heap_blocks_list.allocateBlock(payload_size);
+}
+
+void *MemoryManager::allocateAlignedBlock(size_t alignment,
+        size_t payload_size) {
+    if (alignment <= BLOCK_SIZE_ALIGNMENT) {
+        // every block is aligned this way
+        return allocateBlock(payload_size);
+    }
+
+    // slabs and thread caches don't sort blocks by alignment, go to the tiers
+    if (payload_size + alignment
+        >= mmap_threshold.load(std::memory_order_relaxed)) {
+        LockGuard guard(mmapped_blocks_lock);
+        return mmapped_blocks.allocateAlignedBlock(alignment, payload_size);
+    }
+
+    Arena* arena = getThreadArena();
+    LockGuard guard(arena->lock);
+    arena->releaseRemoteFreedBlocks();
+    return arena->heap_blocks_list.allocateAlignedBlock(alignment, payload_size);
+}
+
+void *MemoryManager::allocateZeroedBlock(size_t payload_size) {
+    if (payload_size <= THREAD_CACHE_MAX_PAYLOAD_SIZE) {
+        void* payload_block_addr = allocateBlock(payload_size);
+        if (payload_block_addr != NULL) {
+            // cached blocks and slots were already used
+            memset(payload_block_addr, 0, payload_size);
+        }
+        return payload_block_addr;
+    }
+
+    if (payload_size >= mmap_threshold.load(std::memory_order_relaxed)) {
+        LockGuard guard(mmapped_blocks_lock);
+        return mmapped_blocks.allocateZeroedBlock(payload_size);
+    }
+
+    Arena* arena = getThreadArena();
+    LockGuard guard(arena->lock);
+    arena->releaseRemoteFreedBlocks();
+    return arena->heap_blocks_list.allocateZeroedBlock(payload_size);
+}
+
+void MemoryManager::releaseUsedBlock(void *payload_addr) {
+    if (slab_allocator.ownsAddress(payload_addr)) {
+        // slots have no metadata to look at
+        thread_cache.cacheSlabSlot(payload_addr);
+        return;
+    }
+
+    releaseBlockWithMetaData(payload_addr);
+}
+
+size_t MemoryManager::allocateBlocks(size_t payload_size, size_t blocks_count,
+        void** payload_addrs) {
+    if ((SMALLOC_SLABS && payload_size <= SLAB_MAX_PAYLOAD_SIZE)
+        || payload_size >= mmap_threshold.load(std::memory_order_relaxed)) {
+        // slots and mmapped blocks aren't cut from a heap block
+        size_t allocated_count = 0;
+        while (allocated_count < blocks_count) {
+            void* payload_addr = allocateBlock(payload_size);
+            if (payload_addr == NULL) {
+                break;
+            }
+            payload_addrs[allocated_count++] = payload_addr;
+        }
+        return allocated_count;
+    }
+
+    Arena* arena = getThreadArena();
+    LockGuard guard(arena->lock);
+    arena->releaseRemoteFreedBlocks();
+    return arena->heap_blocks_list.allocateBlocks(payload_size, blocks_count,
+            payload_addrs);
+}
+
+void MemoryManager::releaseUsedBlocks(void **payload_addrs,
+        size_t blocks_count) {
+    Arena* arena = thread_cache.arena;
+
+    // the blocks of the thread's heap are moved to the front of the array
+    size_t heap_blocks_count = 0;
+    void* prev_payload_addr = NULL;
+    for (size_t i = 0; i < blocks_count; i++) {
+        void* payload_addr = payload_addrs[i];
+        if (payload_addr == NULL || payload_addr == prev_payload_addr) {
+            // we allow double free
+            continue;
+        }
+        prev_payload_addr = payload_addr;
+
+        if (arena != NULL
+            && page_map.get(payload_addr) == PAGE_HEAP + (arena - arenas)) {
+            auto* block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+            if (!block_metadata->hasFlag(FREE_FLAG)
+                && !block_metadata->isCached()) {
+                payload_addrs[heap_blocks_count++] = payload_addr;
+                continue;
+            }
+        }
+
+        releaseUsedBlock(payload_addr);
+    }
+
+    if (heap_blocks_count > 0) {
+        LockGuard guard(arena->lock);
+        arena->heap_blocks_list.releaseUsedBlocks(payload_addrs,
+                heap_blocks_count);
+    }
+}
+
+void MemoryManager::releaseSizedBlock(void *payload_addr, size_t payload_size) {
+#ifdef SMALLOC_DEBUG
+    checkBlockSize(payload_addr, payload_size);
+#endif
+
+    // a slot is never handed out for more than SLAB_MAX_PAYLOAD_SIZE bytes
+    if (payload_size <= SLAB_MAX_PAYLOAD_SIZE
+        && slab_allocator.ownsAddress(payload_addr)) {
+        thread_cache.cacheSlabSlot(payload_addr);
+        return;
+    }
+
+    releaseBlockWithMetaData(payload_addr);
+}
+
+#ifdef SMALLOC_DEBUG
+void MemoryManager::checkBlockSize(void *payload_addr, size_t payload_size) {
+    size_t block_payload_size;
+    if (slab_allocator.ownsAddress(payload_addr)) {
+        block_payload_size = SlabAllocator::getSlab(payload_addr)->slot_size;
+    } else {
+        auto* block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+        if (block_metadata->hasFlag(FREE_FLAG)
+            || block_metadata->isCached()) {
+            // double free, its size isn't known anymore
+            return;
+        }
+        block_payload_size = block_metadata->getPayloadSize();
+    }
+
+    if (payload_size > block_payload_size) {
+        const char message[] = "ssized_free(): size is larger than the block\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        abort();
+    }
+}
+#endif
+
+void MemoryManager::releaseBlockWithMetaData(void *payload_addr) {
+    // the page map routes the block, its metadata is only checked
+    uint8_t page_entry = page_map.get(payload_addr);
+    if (page_entry == PAGE_UNKNOWN) {
+        /* an mmapped block released before, whose pages may be unmapped. We
+         * allow double free */
+        return;
+    }
+
+    auto* block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+    if (block_metadata->hasFlag(FREE_FLAG)
+        || block_metadata->isCached()) {
+        // block is already free or in a thread cache. We allow double free
+        return;
+    }
+
+    if (page_entry == PAGE_MMAPPED_BLOCK) {
+        // the block may be unmapped once released
+        size_t block_size = block_metadata->getBlockSize();
+        uint64_t allocation_time_ms =
+                block_metadata->getMMappedAllocationTimeMs();
+        {
+            LockGuard guard(mmapped_blocks_lock);
+            mmapped_blocks.releaseUsedBlock(payload_addr);
+        }
+        adaptMMapThreshold(block_size, allocation_time_ms);
+        return;
+    }
+
+    if (thread_cache.cacheBlock(block_metadata)) {
+        return;
+    }
+
+    Arena* arena = getPageArena(page_entry);
+    if (arena != thread_cache.arena) {
+        // don't wait for the lock of another arena
+        block_metadata->setCached(true);
+        arena->pushRemoteFreedBlocks(block_metadata, block_metadata);
+        return;
+    }
+
+    LockGuard guard(arena->lock);
+    arena->heap_blocks_list.releaseUsedBlock(payload_addr);
+}
+
+void *MemoryManager::reallocateActiveBlock(void *old_payload_addr,
+        size_t new_payload_size) {
+    if (old_payload_addr == NULL) {
+        // act like a call to smalloc(new_payload_size)
+        return allocateBlock(new_payload_size);
+    }
+    if (slab_allocator.ownsAddress(old_payload_addr)) {
+        return reallocateSlabSlot(old_payload_addr, new_payload_size);
+    }
+
+    uint8_t page_entry = page_map.get(old_payload_addr);
+    if (page_entry == PAGE_UNKNOWN) {
+        /* an mmapped block released before, whose pages may be unmapped.
+         * Nothing is left to copy */
+        return NULL;
+    }
+
+    bool new_block_is_mmapped =
+            new_payload_size >= mmap_threshold.load(std::memory_order_relaxed);
+
+    if ((page_entry == PAGE_MMAPPED_BLOCK) != new_block_is_mmapped) {
+        return reallocateToOtherTier(old_payload_addr, new_payload_size);
+    }
+
+    if (new_block_is_mmapped) {
+        LockGuard guard(mmapped_blocks_lock);
+        return mmapped_blocks.reallocateActiveBlock(old_payload_addr,
+                new_payload_size);
+    }
+
+    Arena* arena = getPageArena(page_entry);
+    LockGuard guard(arena->lock);
+    arena->releaseRemoteFreedBlocks();
+    return arena->heap_blocks_list.reallocateActiveBlock(old_payload_addr,
+            new_payload_size);
+}
+
+void *MemoryManager::reallocateToOtherTier(void *old_payload_addr,
+        size_t new_payload_size) {
+    auto* old_block_metadata = MallocMetadata::getBlockMetadata(old_payload_addr);
+    size_t old_payload_size = old_block_metadata->getPayloadSize();
+
+    /* a block that still fits stays where it is: a heap block growing into
+     * its spare bytes, or an mmapped block shrinking within its last page */
+    if (new_payload_size <= old_payload_size
+        && (!old_block_metadata->hasFlag(MMAPPED_FLAG)
+            || old_payload_size - new_payload_size < (size_t)getpagesize())) {
+        return old_payload_addr;
+    }
+
+    void* new_payload_addr = allocateBlock(new_payload_size);
+    if (new_payload_addr != NULL) {
+        // the requested size isn't kept, so the whole payload is copied
+        memmove(new_payload_addr, old_payload_addr,
+                min(new_payload_size, old_payload_size));
+        releaseUsedBlock(old_payload_addr);
+    }
+
+    return new_payload_addr;
+}
+
+void *MemoryManager::reallocateSlabSlot(void *old_slot_addr,
+        size_t new_payload_size) {
+    size_t slot_size = SlabAllocator::getSlab(old_slot_addr)->slot_size;
+    if (new_payload_size <= slot_size) {
+        // current slot is large enough
+        return old_slot_addr;
+    }
+
+    // the requested size isn't known, so the whole slot is copied
+    void* new_payload_addr = allocateBlock(new_payload_size);
+    if (new_payload_addr != NULL) {
+        memmove(new_payload_addr, old_slot_addr, slot_size);
+        releaseUsedBlock(old_slot_addr);
+    }
+
+    return new_payload_addr;
+}
+
+MallocMetadata* MemoryManager::allocateCachedBlocks(size_t payload_size,
+        size_t blocks_count) {
+    MallocMetadata* allocated_blocks = NULL;
+
+    Arena* arena = getThreadArena();
+    LockGuard guard(arena->lock);
+    arena->releaseRemoteFreedBlocks();
+    for (size_t i = 0; i < blocks_count; i++) {
+        /* only the first block may grow the heap. Blocks cut ahead of time
+         * from free ones merge back into them when flushed, those from the
+         * top chunk would stay free blocks */
+        void* payload_addr = i == 0
+                ? arena->heap_blocks_list.allocateBlock(payload_size)
+                : arena->heap_blocks_list.allocateFreeBlock(payload_size);
+        if (payload_addr == NULL) {
+            // sbrk() failed or no free block is left, return what we have
+            break;
+        }
+
+        auto* block_metadata = MallocMetadata::getBlockMetadata(payload_addr);
+        block_metadata->setCached(true);
+        block_metadata->nextFree() = allocated_blocks;
+        allocated_blocks = block_metadata;
+    }
+
+    return allocated_blocks;
+}
+
+void MemoryManager::releaseCachedBlocks(MallocMetadata *first_block_metadata) {
+    /* runs of blocks of the same arena are released at once. Runs of the
+     * thread's own arena under one lock, others are pushed to their arena */
+    while (first_block_metadata != NULL) {
+        Arena* arena = findOwnerArena(first_block_metadata);
+
+        MallocMetadata* last_block_metadata = first_block_metadata;
+        while (last_block_metadata->nextFree() != NULL
+               && findOwnerArena(last_block_metadata->nextFree()) == arena) {
+            last_block_metadata = last_block_metadata->nextFree();
+        }
+        MallocMetadata* next_run_metadata = last_block_metadata->nextFree();
+        last_block_metadata->nextFree() = NULL;
+
+        if (arena == thread_cache.arena) {
+            LockGuard guard(arena->lock);
+            arena->releaseBlocks(first_block_metadata);
+        } else {
+            arena->pushRemoteFreedBlocks(first_block_metadata,
+                    last_block_metadata);
+        }
+
+        first_block_metadata = next_run_metadata;
+    }
+}
+
+Arena* MemoryManager::getThreadArena() {
+    if (thread_cache.arena != NULL) {
+        return thread_cache.arena;
+    }
+
+    size_t count = arenas_count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        long cpus_count = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus_count < 1 ? 1 : min(cpus_count, MAX_ARENAS_COUNT);
+
+        // keep the count if another thread (or smallopt) set it first
+        size_t expected = 0;
+        if (!arenas_count.compare_exchange_strong(expected, count)) {
+            count = expected;
+        }
+    }
+
+    thread_cache.arena = &arenas[next_arena_index.fetch_add(1) % count];
+
+    return thread_cache.arena;
+}
+
+Arena* MemoryManager::findOwnerArena(MallocMetadata *block_metadata) {
+    // the metadata is in the heap, like the payload
+    return getPageArena(page_map.get(block_metadata));
+}
+
+Arena* MemoryManager::getPageArena(uint8_t page_entry) {
+#ifdef SMALLOC_DEBUG
+    if (page_entry < PAGE_HEAP) {
+        const char message[] = "smalloc: page isn't in the heap of an arena\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        abort();
+    }
+#endif
+
+    return &arenas[page_entry - PAGE_HEAP];
+}
+
+bool MemoryManager::ownsBlock(void *payload_addr) {
+    if (slab_allocator.ownsAddress(payload_addr)) {
+        return true;
+    }
+
+    uint8_t page_entry = page_map.get(payload_addr);
+    if (page_entry == PAGE_HEAP) {
+        /* on the sbrk() heap of arenas[0], whose first and last pages may be
+         * shared with others */
+        return arenas[0].heap_blocks_list.ownsHeapAddress(payload_addr);
+    }
+
+    return page_entry != PAGE_UNKNOWN;
+}
+
+size_t MemoryManager::getUsableSize(void *payload_addr) {
+    if (slab_allocator.ownsAddress(payload_addr)) {
+        return SlabAllocator::getSlab(payload_addr)->slot_size;
+    }
+
+    return MallocMetadata::getBlockMetadata(payload_addr)->getPayloadSize();
+}
+
+void MemoryManager::lockAll() {
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        arenas[i].lock.acquire();
+    }
+    mmapped_blocks_lock.acquire();
+    for (size_t i = 0; i < SLAB_CLASSES_COUNT; i++) {
+        slab_allocator.classes[i].lock.acquire();
+    }
+    slab_allocator.region_lock.acquire();
+}
+
+void MemoryManager::unlockAll() {
+    slab_allocator.region_lock.release();
+    for (size_t i = 0; i < SLAB_CLASSES_COUNT; i++) {
+        slab_allocator.classes[i].lock.release();
+    }
+    mmapped_blocks_lock.release();
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        arenas[i].lock.release();
+    }
+}
+
+bool MemoryManager::setArenasCount(size_t count) {
+    if (count < 1 || count > MAX_ARENAS_COUNT) {
+        return false;
+    }
+
+    arenas_count.store(count);
+
+    return true;
+}
+
+bool MemoryManager::setTrimThreshold(int threshold) {
+    if (threshold < 0) {
+        return false;
+    }
+
+    is_trim_threshold_set.store(true);
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].heap_blocks_list.trim_threshold = threshold;
+    }
+
+    return true;
+}
+
+void MemoryManager::adaptMMapThreshold(size_t block_size,
+        uint64_t allocation_time_ms) {
+    /* the payload is smaller than the block, so allocations of the same size
+     * go to the heap from now on */
+    size_t threshold = mmap_threshold.load(std::memory_order_relaxed);
+    if (block_size <= threshold
+        || block_size > mmap_threshold_max.load(std::memory_order_relaxed)
+        || !is_mmap_threshold_dynamic.load(std::memory_order_relaxed)
+        || getMonotonicTimeMs() - allocation_time_ms >= SHORT_LIVED_BLOCK_MS) {
+        return;
+    }
+
+    do {
+        if (block_size <= threshold) {
+            // raised further by another thread meanwhile
+            return;
+        }
+    } while (!mmap_threshold.compare_exchange_weak(threshold, block_size,
+            std::memory_order_relaxed));
+
+    if (is_trim_threshold_set.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    /* like in glibc, heaps keep twice the threshold free, so blocks moved to
+     * the heap aren't trimmed and grown again each time */
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        HeapBlocksList& heap_blocks_list = arenas[i].heap_blocks_list;
+        heap_blocks_list.trim_threshold = max(heap_blocks_list.trim_threshold,
+                                              2 * block_size);
+    }
+}
+
+bool MemoryManager::setMMapThreshold(SmalloptParam param, int threshold) {
+    // smaller blocks are served before the tiers are chosen
+    if (threshold <= (int)THREAD_CACHE_MAX_PAYLOAD_SIZE
+        || (size_t)threshold > MMAP_THRESHOLD_LIMIT) {
+        return false;
+    }
+
+    if (param == M_MMAP_THRESHOLD) {
+        is_mmap_threshold_dynamic.store(false);
+        mmap_threshold.store(threshold);
+    } else if (param == M_MMAP_THRESHOLD_MIN) {
+        is_mmap_threshold_dynamic.store(true);
+        mmap_threshold.store(threshold);
+        if (mmap_threshold_max.load() < (size_t)threshold) {
+            mmap_threshold_max.store(threshold);
+        }
+    } else {
+        mmap_threshold_max.store(threshold);
+        if (mmap_threshold.load() > (size_t)threshold) {
+            mmap_threshold.store(threshold);
+        }
+    }
+
+    return true;
+}
+
+bool MemoryManager::setMMapCacheMaxBytes(int max_bytes) {
+    if (max_bytes < 0) {
+        return false;
+    }
+
+    LockGuard guard(mmapped_blocks_lock);
+    mmapped_blocks.setCacheMaxBytes(max_bytes);
+
+    return true;
+}
+
+bool MemoryManager::setHeapGrowthSize(SmalloptParam param, int size) {
+    if (size <= 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        HeapBlocksList& heap_blocks_list = arenas[i].heap_blocks_list;
+
+        if (param == M_HEAP_GROWTH_MIN) {
+            heap_blocks_list.min_growth_size = size;
+            heap_blocks_list.max_growth_size =
+                    max(heap_blocks_list.max_growth_size, size);
+        } else {
+            heap_blocks_list.max_growth_size = size;
+            heap_blocks_list.min_growth_size =
+                    min(heap_blocks_list.min_growth_size, size);
+        }
+        heap_blocks_list.growth_size = heap_blocks_list.min_growth_size;
+    }
+
+    return true;
+}
+
+bool MemoryManager::setHugePagesMode(int mode) {
+    if (mode < HUGE_PAGES_NONE || mode > HUGE_PAGES_HUGETLB) {
+        return false;
+    }
+
+    LockGuard guard(mmapped_blocks_lock);
+    mmapped_blocks.huge_pages_mode = (HugePagesMode)mode;
+
+    return true;
+}
+
+bool MemoryManager::setHeapHugePages(int use_huge_pages) {
+    if (use_huge_pages != 0 && use_huge_pages != 1) {
+        return false;
+    }
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].heap_blocks_list.use_huge_pages = use_huge_pages;
+    }
+
+    return true;
+}
+
+size_t MemoryManager::getHugePageBytesCount() {
+    size_t bytes_count = 0;
+    {
+        LockGuard guard(mmapped_blocks_lock);
+        bytes_count += mmapped_blocks.hugetlb_bytes_count;
+    }
+
+    /* only the kernel knows which pages are backed by transparent huge
+     * pages. Read it without stdio, which allocates */
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+    if (fd < 0) {
+        return bytes_count;
+    }
+
+    char buffer[4096];
+    ssize_t read_size = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (read_size <= 0) {
+        return bytes_count;
+    }
+    buffer[read_size] = '\0';
+
+    const char* field = strstr(buffer, "AnonHugePages:");
+    if (field == NULL) {
+        return bytes_count;
+    }
+
+    size_t kb_count = 0;
+    for (field += strlen("AnonHugePages:"); *field == ' '; field++) {}
+    for (; *field >= '0' && *field <= '9'; field++) {
+        kb_count = kb_count * 10 + (*field - '0');
+    }
+
+    return bytes_count + kb_count * KB;
+}
+
+bool MemoryManager::reserveHeap(size_t size) {
+    Arena* arena = getThreadArena();
+    LockGuard guard(arena->lock);
+
+    return arena->heap_blocks_list.reserveTop(size);
+}
+
+bool MemoryManager::trimHeaps(size_t pad) {
+    bool released = false;
+
+    {
+        LockGuard guard(mmapped_blocks_lock);
+        released = mmapped_blocks.cached_bytes_count != 0;
+        mmapped_blocks.releaseExpiredMappings(0);
+    }
+
+    // blocks in the cache of this thread can be trimmed too
+    thread_cache.flushAll();
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].releaseRemoteFreedBlocks();
+
+        HeapBlocksList& heap_blocks_list = arenas[i].heap_blocks_list;
+        released |= heap_blocks_list.trimHeap(pad);
+        released |= heap_blocks_list.releaseFreeBlocksPages();
+    }
+
+    return released;
+}
+
+size_t MemoryManager::getBlocksCount(BytesType type) {
+    // see _num_free_blocks()
+    thread_cache.flushAll();
+
+    size_t blocks_count = 0;
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].releaseRemoteFreedBlocks();
+        blocks_count += arenas[i].heap_blocks_list.blocks_count[type];
+    }
+
+    if (type == TOTAL) {
+        LockGuard guard(mmapped_blocks_lock);
+        blocks_count += mmapped_blocks.total_blocks_count;
+    }
+
+    // released slots leave the counts, see _num_free_blocks()
+    if (type == TOTAL) {
+        for (size_t i = 0; i < SLAB_CLASSES_COUNT; i++) {
+            LockGuard guard(slab_allocator.classes[i].lock);
+            blocks_count += slab_allocator.classes[i].used_slots_count;
+        }
+    }
+
+    return blocks_count;
+}
+
+size_t MemoryManager::getBytesCount(BytesType type) {
+    // see _num_free_blocks()
+    thread_cache.flushAll();
+
+    size_t bytes_count = 0;
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].releaseRemoteFreedBlocks();
+        bytes_count += arenas[i].heap_blocks_list.bytes_count[type];
+        if (type == TOTAL) {
+            bytes_count -= arenas[i].heap_blocks_list.blocks_count[TOTAL]
+                           * getMetaDataSize();
+        }
+    }
+
+    if (type == TOTAL) {
+        LockGuard guard(mmapped_blocks_lock);
+        bytes_count += mmapped_blocks.total_bytes_count;
+    }
+
+    // released slots leave the counts, see _num_free_blocks()
+    if (type == TOTAL) {
+        for (size_t i = 0; i < SLAB_CLASSES_COUNT; i++) {
+            LockGuard guard(slab_allocator.classes[i].lock);
+            bytes_count += slab_allocator.classes[i].used_slots_count
+                           * (i + 1) * SLAB_SLOT_SIZE_STEP;
+        }
+    }
+
+    return bytes_count;
+}
+
+size_t MemoryManager::getMetaDataBytesCount() {
+    // see _num_free_blocks()
+    thread_cache.flushAll();
+
+    size_t bytes_count = 0;
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].releaseRemoteFreedBlocks();
+        bytes_count += arenas[i].heap_blocks_list.blocks_count[TOTAL]
+                       * getMetaDataSize();
+    }
+
+    {
+        LockGuard guard(mmapped_blocks_lock);
+        bytes_count += mmapped_blocks.total_blocks_count
+                       * MMAPPED_BLOCK_PREFIX_SIZE;
+    }
+
+    return bytes_count;
+}
+
+size_t MemoryManager::getMetaDataSize() {
+    return sizeof(MallocMetadata);
+}
+
+void MemoryManager::getStats(SmallocStats &stats) {
+    memset(&stats, 0, sizeof(stats));
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].releaseRemoteFreedBlocks();
+        arenas[i].heap_blocks_list.addToStats(stats);
+    }
+
+    {
+        LockGuard guard(mmapped_blocks_lock);
+        mmapped_blocks.addToStats(stats);
+    }
+
+    slab_allocator.addToStats(stats);
+
+    stats.sbrk_calls_count = system_calls_counters.getCallsCount(SBRK_CALL);
+    stats.mmap_calls_count = system_calls_counters.getCallsCount(MMAP_CALL);
+    stats.munmap_calls_count = system_calls_counters.getCallsCount(MUNMAP_CALL);
+    stats.mremap_calls_count = system_calls_counters.getCallsCount(MREMAP_CALL);
+    stats.mprotect_calls_count =
+            system_calls_counters.getCallsCount(MPROTECT_CALL);
+    stats.madvise_calls_count =
+            system_calls_counters.getCallsCount(MADVISE_CALL);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        // in KB
+        stats.peak_rss_bytes = (size_t)usage.ru_maxrss * KB;
+    }
+}
+
+void MemoryManager::getFragmentation(SmallocFragmentation &fragmentation) {
+    memset(&fragmentation, 0, sizeof(fragmentation));
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        LockGuard guard(arenas[i].lock);
+        arenas[i].releaseRemoteFreedBlocks();
+        arenas[i].heap_blocks_list.addToFragmentation(fragmentation);
+    }
+
+    if (fragmentation.free_bytes != 0) {
+        fragmentation.external_fragmentation =
+                1 - (double)fragmentation.largest_free_block
+                    / fragmentation.free_bytes;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+/* sampling heap profiler. The gaps between sampled bytes are drawn from an
+ * exponential distribution of mean sample_rate, so every allocated byte has
+ * the same chance to be sampled. A sampled allocation is recorded with its
+ * backtrace, weighted by the bytes it stands for */
+
+const size_t PROFILE_MAX_DEPTH = 32;
+// sizes of the hash tables, powers of 2. They are kept at most half full
+const size_t PROFILE_STACKS_COUNT = 16 * KB;
+const size_t PROFILE_LIVE_SAMPLES_COUNT = 64 * KB;
+// counts of live samples by address hash, so frees rarely take the lock
+const size_t PROFILE_FILTER_SIZE = 16 * KB;
+
+class ProfileStack {
+public:
+    // 0 if the entry is unused
+    size_t depth;
+    // return addresses, innermost first
+    void* frames[PROFILE_MAX_DEPTH];
+    uint64_t hash;
+    size_t allocated_bytes;
+    size_t live_bytes;
+};
+
+class LiveSample {
+public:
+    // NULL if the entry is unused
+    void* payload_addr;
+    size_t weight;
+    ProfileStack* stack;
+};
+
+class HeapProfiler {
+public:
+    // 0 if sampling is off
+    std::atomic<size_t> sample_rate{0};
+    std::atomic<size_t> live_samples_count{0};
+    std::atomic<uint32_t> filter[PROFILE_FILTER_SIZE]{};
+
+    // guards the tables
+    Lock lock;
+    // mapped when sampling is first turned on
+    ProfileStack* stacks = NULL;
+    size_t stacks_count = 0;
+    LiveSample* live_samples = NULL;
+    // samples that didn't fit in the tables
+    size_t dropped_samples_count = 0;
+
+    bool setSampleRate(int rate);
+
+    static uint64_t getAddressHash(void* addr);
+
+    // lock held. NULL if the table is full
+    ProfileStack* findStack(void** frames, size_t depth);
+
+    void recordSample(void* payload_addr, size_t weight, void** frames,
+            size_t depth);
+
+    // forget @payload_addr if it was sampled. Called before it is freed
+    void releaseSample(void* payload_addr);
+
+    // lock held
+    void removeLiveSample(size_t index);
+};
+
+HeapProfiler heap_profiler;
+
+// the sampling state of a thread
+class ProfileSampler {
+public:
+    size_t bytes_until_sample;
+    // 0 until the thread first allocates with sampling on
+    uint64_t random_state;
+    // on while sampling, so allocations of backtrace() aren't sampled
+    bool is_sampling;
+
+    // called after every allocation
+    void countAllocation(void* payload_addr, size_t payload_size);
+
+    // the allocation crossed the next sampled byte
+    void takeSample(void* payload_addr, size_t payload_size);
+
+    size_t drawSampleGap(size_t sample_rate);
+};
+
+__thread ProfileSampler profile_sampler
+        __attribute__((tls_model("initial-exec")));
+
+// ----------------------------------------------------------------------------
+
+bool HeapProfiler::setSampleRate(int rate) {
+    if (rate < 0) {
+        return false;
+    }
+
+    if (rate > 0) {
+        LockGuard guard(lock);
+        if (stacks == NULL) {
+            size_t tables_size = PROFILE_STACKS_COUNT * sizeof(ProfileStack)
+                                 + PROFILE_LIVE_SAMPLES_COUNT
+                                   * sizeof(LiveSample);
+            system_calls_counters.count(MMAP_CALL);
+            void* tables_addr = mmap(NULL, tables_size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                     -1, 0);
+            if (tables_addr == MAP_FAILED) {
+                return false;
+            }
+            stacks = (ProfileStack*)tables_addr;
+            live_samples = (LiveSample*)(stacks + PROFILE_STACKS_COUNT);
+        }
+    }
+
+    sample_rate.store(rate, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t HeapProfiler::getAddressHash(void *addr) {
+    // payloads are 16 bytes aligned
+    return ((uintptr_t)addr >> 4) * 0x9e3779b97f4a7c15;
+}
+
+ProfileStack* HeapProfiler::findStack(void **frames, size_t depth) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3;
+    }
+
+    for (size_t i = 0; i < PROFILE_STACKS_COUNT; i++) {
+        ProfileStack* stack = &stacks[(hash + i) & (PROFILE_STACKS_COUNT - 1)];
+        if (stack->depth == 0) {
+            if (stacks_count >= PROFILE_STACKS_COUNT / 2) {
+                return NULL;
+            }
+            stacks_count++;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(void*));
+            stack->hash = hash;
+            return stack;
+        }
+        if (stack->hash == hash && stack->depth == depth
+            && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0) {
+            return stack;
+        }
+    }
+
+    return NULL;
+}
+
+void HeapProfiler::recordSample(void *payload_addr, size_t weight,
+        void **frames, size_t depth) {
+    LockGuard guard(lock);
+
+    ProfileStack* stack = depth > 0 ? findStack(frames, depth) : NULL;
+    if (stack == NULL
+        || live_samples_count.load(std::memory_order_relaxed)
+           >= PROFILE_LIVE_SAMPLES_COUNT / 2) {
+        dropped_samples_count++;
+        return;
+    }
+
+    uint64_t hash = getAddressHash(payload_addr);
+    size_t index = hash & (PROFILE_LIVE_SAMPLES_COUNT - 1);
+    while (live_samples[index].payload_addr != NULL) {
+        index = (index + 1) & (PROFILE_LIVE_SAMPLES_COUNT - 1);
+    }
+
+    live_samples[index].payload_addr = payload_addr;
+    live_samples[index].weight = weight;
+    live_samples[index].stack = stack;
+    stack->allocated_bytes += weight;
+    stack->live_bytes += weight;
+
+    filter[hash & (PROFILE_FILTER_SIZE - 1)].fetch_add(1,
+            std::memory_order_relaxed);
+    live_samples_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::releaseSample(void *payload_addr) {
+    uint64_t hash = getAddressHash(payload_addr);
+    if (filter[hash & (PROFILE_FILTER_SIZE - 1)].load(
+            std::memory_order_relaxed) == 0) {
+        // the allocation wasn't sampled
+        return;
+    }
+
+    LockGuard guard(lock);
+    size_t index = hash & (PROFILE_LIVE_SAMPLES_COUNT - 1);
+    while (live_samples[index].payload_addr != NULL) {
+        if (live_samples[index].payload_addr == payload_addr) {
+            live_samples[index].stack->live_bytes -= live_samples[index].weight;
+            removeLiveSample(index);
+
+            filter[hash & (PROFILE_FILTER_SIZE - 1)].fetch_sub(1,
+                    std::memory_order_relaxed);
+            live_samples_count.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        index = (index + 1) & (PROFILE_LIVE_SAMPLES_COUNT - 1);
+    }
+}
+
+void HeapProfiler::removeLiveSample(size_t index) {
+    /* no tombstones, the samples after it in the probe sequence are moved
+     * back so lookups still stop at the first unused entry */
+    size_t mask = PROFILE_LIVE_SAMPLES_COUNT - 1;
+    size_t next_index = index;
+    while (true) {
+        live_samples[index].payload_addr = NULL;
+
+        while (true) {
+            next_index = (next_index + 1) & mask;
+            if (live_samples[next_index].payload_addr == NULL) {
+                return;
+            }
+
+            size_t home_index =
+                    getAddressHash(live_samples[next_index].payload_addr) & mask;
+            // distance from home, the sample can move back if it isn't shorter
+            if (((next_index - home_index) & mask)
+                >= ((next_index - index) & mask)) {
+                break;
+            }
+        }
+
+        live_samples[index] = live_samples[next_index];
+        index = next_index;
+    }
+}
+
+void ProfileSampler::countAllocation(void *payload_addr, size_t payload_size) {
+    if (payload_addr == NULL
+        || heap_profiler.sample_rate.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    if (bytes_until_sample > payload_size) {
+        bytes_until_sample -= payload_size;
+        return;
+    }
+
+    takeSample(payload_addr, payload_size);
+}
+
+__attribute__((noinline))
+void ProfileSampler::takeSample(void *payload_addr, size_t payload_size) {
+    size_t sample_rate = heap_profiler.sample_rate.load(std::memory_order_relaxed);
+    if (random_state == 0) {
+        // the threads get different seeds from their own addresses
+        random_state = ((uintptr_t)this * 0x9e3779b97f4a7c15) | 1;
+        bytes_until_sample = drawSampleGap(sample_rate);
+        if (bytes_until_sample > payload_size) {
+            bytes_until_sample -= payload_size;
+            return;
+        }
+    }
+    bytes_until_sample = drawSampleGap(sample_rate);
+
+    if (is_sampling) {
+        return;
+    }
+    is_sampling = true;
+
+    void* frames[PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + 1);
+
+    /* an allocation of s bytes is sampled with probability 1 - e^(-s/rate),
+     * so it stands for s / (1 - e^(-s/rate)) bytes */
+    double weight = payload_size
+                    / (1 - exp(-(double)payload_size / sample_rate));
+
+    // without the frame of this function
+    heap_profiler.recordSample(payload_addr, (size_t)weight, frames + 1,
+            depth > 1 ? depth - 1 : 0);
+
+    is_sampling = false;
+}
+
+size_t ProfileSampler::drawSampleGap(size_t sample_rate) {
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    uint64_t random_bits = random_state * 0x2545f4914f6cdd1d;
+
+    // uniform in (0, 1]
+    double uniform = ((random_bits >> 11) + 1) * (1.0 / (1ULL << 53));
+    return (size_t)(-log(uniform) * sample_rate) + 1;
+}
+
+// ----------------------------------------------------------------------------
+
+/* allocation tracer. Every thread appends to its own buffer and writes it to
+ * the trace with one write() when it fills up, so tracing threads never wait
+ * for each other. Buffers are mmapped and kept in a list, and the buffer of
+ * an exited thread goes to the next thread that traces */
+
+const size_t TRACE_BUFFER_RECORDS_COUNT = 4 * KB;
+
+class TraceBuffer {
+public:
+    // never removed from the list, so it can be walked without a lock
+    TraceBuffer* next;
+    // false once the owner thread exited
+    std::atomic<bool> is_owned;
+    // set by the owner thread while appending, smalloc_trace_stop() waits
+    std::atomic<bool> is_appending;
+    uint16_t thread;
+    size_t records_count;
+    SmallocTraceRecord records[TRACE_BUFFER_RECORDS_COUNT];
+
+    // by the appending thread, or after tracing stopped
+    void flush();
+};
+
+class Tracer {
+public:
+    std::atomic<bool> is_started{false};
+    std::atomic<bool> is_tracing{false};
+    int fd = -1;
+    std::atomic<bool> write_failed{false};
+    std::atomic<TraceBuffer*> buffers{NULL};
+    std::atomic<uint16_t> threads_count{0};
+
+    pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+    pthread_key_t buffer_key = 0;
+
+    bool start(int trace_fd);
+
+    bool stop();
+
+    void record(SmallocTraceOp op, void* pointer, uint64_t argument,
+            size_t size);
+
+    // NULL if a buffer couldn't be mapped
+    TraceBuffer* getThreadBuffer();
+
+    /* in the child after fork(). Tracing stops, and the buffered records are
+     * dropped, as the parent writes them */
+    void resetAfterFork();
+
+    // @data_size bytes of @data, false on failure
+    bool write(const void* data, size_t data_size);
+};
 
-    return canReallocateUsingPredOnly(old_block_metadata, new_payload_size)
-        || canReallocateUsingSuccOnly(old_block_metadata, new_payload_size)
-        || canReallocateUsingPredAndSucc(old_block_metadata, new_payload_size);
-}
+Tracer tracer;
 
-bool HeapBlocksList::canReallocateUsingPredOnly(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    if (old_block_metadata->prev == NULL) {
-        return false;
-    }
-    if (!old_block_metadata->prev->is_free) {
-        return false;
-    }
+__thread TraceBuffer* trace_buffer __attribute__((tls_model("initial-exec")));
 
-    size_t pred_payload_size = old_block_metadata->prev->size[TOTAL_PAYLOAD];
-    size_t total_avail_payload_size = pred_payload_size
-                                      + sizeof(MallocMetadata)
-                                      + old_block_metadata->size[TOTAL_PAYLOAD];
+// ----------------------------------------------------------------------------
 
-    return total_avail_payload_size >= new_payload_size;
+void TraceBuffer::flush() {
+    if (records_count != 0 && !tracer.write(records,
+            records_count * sizeof(SmallocTraceRecord))) {
+        tracer.write_failed.store(true);
+    }
+    records_count = 0;
 }
 
-bool HeapBlocksList::canReallocateUsingSuccOnly(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    if (old_block_metadata->next == NULL) {
+bool Tracer::start(int trace_fd) {
+    if (is_started.exchange(true)) {
         return false;
     }
-    if (!old_block_metadata->next->is_free) {
+
+    fd = trace_fd;
+    write_failed.store(false);
+    if (!write(SMALLOC_TRACE_MAGIC, sizeof(SMALLOC_TRACE_MAGIC))) {
+        is_started.store(false);
         return false;
     }
 
-    size_t succ_payload_size = old_block_metadata->next->size[TOTAL_PAYLOAD];
-    size_t total_avail_payload_size = old_block_metadata->size[TOTAL_PAYLOAD]
-                                      + sizeof(MallocMetadata)
-                                      + succ_payload_size;
-
-    return total_avail_payload_size >= new_payload_size;
+    is_tracing.store(true);
+    return true;
 }
 
-bool HeapBlocksList::canReallocateUsingPredAndSucc(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    if (old_block_metadata->prev == NULL || old_block_metadata->next == NULL) {
-        return false;
-    }
-    if (!old_block_metadata->prev->is_free || !old_block_metadata->next->is_free) {
+bool Tracer::stop() {
+    if (!is_tracing.exchange(false)) {
         return false;
     }
 
-    size_t pred_payload_size = old_block_metadata->prev->size[TOTAL_PAYLOAD];
-    size_t succ_payload_size = old_block_metadata->next->size[TOTAL_PAYLOAD];
-    size_t total_avail_payload_size = pred_payload_size
-            + sizeof(MallocMetadata) + old_block_metadata->size[TOTAL_PAYLOAD]
-            + sizeof(MallocMetadata) + succ_payload_size;
+    for (TraceBuffer* buffer = buffers.load(); buffer != NULL;
+         buffer = buffer->next) {
+        // appends that saw tracing on are done once the flag clears
+        while (buffer->is_appending.load()) {
+            sched_yield();
+        }
+        buffer->flush();
+    }
 
-    return total_avail_payload_size >= new_payload_size;
+    bool is_written = !write_failed.load();
+    is_started.store(false);
+    return is_written;
 }
 
-void* HeapBlocksList::reallocateUsingPredOrSucc(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    // here we can reallocate using pred and/or succ
-
-    // try using pred only
-    if (canReallocateUsingPredOnly(old_block_metadata, new_payload_size)) {
-        return reallocateUsingPredOnly(old_block_metadata, new_payload_size);
+void Tracer::record(SmallocTraceOp op, void *pointer, uint64_t argument,
+        size_t size) {
+    TraceBuffer* buffer = getThreadBuffer();
+    if (buffer == NULL) {
+        write_failed.store(true);
+        return;
     }
 
-    // if pred not large enough, try using succ only
-    if (canReallocateUsingSuccOnly(old_block_metadata, new_payload_size)) {
-        return reallocateUsingSuccOnly(old_block_metadata, new_payload_size);
+    // seq_cst, so either stop() waits for this append or it's skipped
+    buffer->is_appending.store(true);
+    if (is_tracing.load()) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        SmallocTraceRecord& record = buffer->records[buffer->records_count++];
+        record.timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        record.pointer = (uintptr_t)pointer;
+        record.argument = argument;
+        record.size = size;
+        record.thread = buffer->thread;
+        record.op = (uint8_t)op;
+        memset(record.reserved, 0, sizeof(record.reserved));
+
+        if (buffer->records_count == TRACE_BUFFER_RECORDS_COUNT) {
+            buffer->flush();
+        }
     }
-
-    // if succ alone not large enough, use both pred and succ
-    // it is promised here that pred and succ combined are large enough
-    return reallocateUsingPredAndSucc(old_block_metadata, new_payload_size);
+    buffer->is_appending.store(false);
 }
 
-void* HeapBlocksList::reallocateUsingPredOnly(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    // here pred exists, free and large enough
+void releaseTraceBufferOnExit(void* buffer) {
+    // destructors of other keys may still allocate and take another buffer
+    trace_buffer = NULL;
+    ((TraceBuffer*)buffer)->is_owned.store(false, std::memory_order_release);
+}
 
-    MallocMetadata* pred_metadata = old_block_metadata->prev;
-    size_t pred_payload_size = pred_metadata->size[TOTAL_PAYLOAD];
-    size_t total_avail_payload_size = pred_payload_size
-                                      + sizeof(MallocMetadata)
-                                      + old_block_metadata->size[TOTAL_PAYLOAD];
+void createTraceBufferKey() {
+    pthread_key_create(&tracer.buffer_key, releaseTraceBufferOnExit);
+}
 
-    pred_metadata->next = old_block_metadata->next;
-    if (tail == old_block_metadata) {
-        tail = pred_metadata;
-    } else {
-        old_block_metadata->next->prev = pred_metadata;
+TraceBuffer* Tracer::getThreadBuffer() {
+    if (trace_buffer != NULL) {
+        return trace_buffer;
     }
 
-    pred_metadata->is_free = false;
-    pred_metadata->size[TOTAL_PAYLOAD] = total_avail_payload_size;
-    pred_metadata->size[ACTIVE_PAYLOAD] = new_payload_size;
-
-    size_t remaining_payload_size = 0;
-    if (total_avail_payload_size - new_payload_size > sizeof(MallocMetadata)) {
-        remaining_payload_size = total_avail_payload_size
-                                 - new_payload_size
-                                 - sizeof(MallocMetadata);
+    TraceBuffer* buffer = buffers.load();
+    for (; buffer != NULL; buffer = buffer->next) {
+        bool is_owned = false;
+        if (buffer->is_owned.compare_exchange_strong(is_owned, true)) {
+            break;
+        }
     }
 
-    if (remaining_payload_size >= SPLITTING_THRESHOLD) {
-        auto* remaining_block_metadata =
-                (MallocMetadata*)((char*)pred_metadata
-                                   + sizeof(MallocMetadata)
-                                   + new_payload_size);
-        remaining_block_metadata->is_free = true;
-        remaining_block_metadata->size[ACTIVE_PAYLOAD] = 0;
-        remaining_block_metadata->size[TOTAL_PAYLOAD] = remaining_payload_size;
-        remaining_block_metadata->prev = pred_metadata;
-        remaining_block_metadata->next = pred_metadata->next;
-
-        if (pred_metadata == tail) {
-            tail = remaining_block_metadata;
-        } else{
-            pred_metadata->next->prev = remaining_block_metadata;
+    if (buffer == NULL) {
+        system_calls_counters.count(MMAP_CALL);
+        void* buffer_addr = mmap(NULL, sizeof(TraceBuffer),
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer_addr == MAP_FAILED) {
+            return NULL;
         }
-        pred_metadata->next = remaining_block_metadata;
+        buffer = (TraceBuffer*)buffer_addr;
+        buffer->is_owned.store(true);
 
-        // blocks_count[TOTAL] doesn't change
-        // blocks_count[FREE] doesn't change
-        // bytes_count[TOTAL] doesn't change
-        bytes_count[FREE] -= pred_payload_size;
-        bytes_count[FREE] += remaining_payload_size;
-    } else {
-        blocks_count[TOTAL]--;
-        blocks_count[FREE]--;
-        // bytes_count[TOTAL] doesn't change
-        bytes_count[FREE] -= pred_payload_size;
+        TraceBuffer* first_buffer = buffers.load();
+        do {
+            buffer->next = first_buffer;
+        } while (!buffers.compare_exchange_weak(first_buffer, buffer));
     }
 
-    memmove(pred_metadata->getPayloadBlockAddr(),
-           old_block_metadata->getPayloadBlockAddr(),
-           old_block_metadata->size[TOTAL_PAYLOAD]); // instead of ACTIVE_PAYLOAD
+    buffer->thread = threads_count.fetch_add(1) + 1;
+    trace_buffer = buffer;
 
-    return pred_metadata->getPayloadBlockAddr();
+    pthread_once(&buffer_key_once, createTraceBufferKey);
+    pthread_setspecific(buffer_key, buffer);
+
+    return buffer;
 }
 
-void* HeapBlocksList::reallocateUsingSuccOnly(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    // here succ exists, free and large enough
+void Tracer::resetAfterFork() {
+    is_tracing.store(false);
+    is_started.store(false);
 
-    MallocMetadata* succ_metadata = old_block_metadata->next;
-    size_t original_succ_payload_size = succ_metadata->size[TOTAL_PAYLOAD];
-    size_t total_avail_payload_size = old_block_metadata->size[TOTAL_PAYLOAD]
-                                      + sizeof(MallocMetadata)
-                                      + original_succ_payload_size;
+    // the buffers of the threads that weren't copied are free to take
+    for (TraceBuffer* buffer = buffers.load(); buffer != NULL;
+         buffer = buffer->next) {
+        buffer->records_count = 0;
+        buffer->is_appending.store(false);
+        buffer->is_owned.store(buffer == trace_buffer);
+    }
+}
 
-    old_block_metadata->next = succ_metadata->next;
-    if (tail == succ_metadata) {
-        tail = old_block_metadata;
-    } else {
-        succ_metadata->next->prev = old_block_metadata;
+bool Tracer::write(const void *data, size_t data_size) {
+    // a write() of a regular file isn't interleaved with those of others
+    while (data_size != 0) {
+        ssize_t written_count = ::write(fd, data, data_size);
+        if (written_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data = (const char*)data + written_count;
+        data_size -= written_count;
     }
 
-    old_block_metadata->size[TOTAL_PAYLOAD] = total_avail_payload_size;
-    old_block_metadata->size[ACTIVE_PAYLOAD] = new_payload_size;
+    return true;
+}
 
-    size_t remaining_payload_size = 0;
-    if (total_avail_payload_size - new_payload_size > sizeof(MallocMetadata)) {
-        remaining_payload_size = total_avail_payload_size
-                                 - new_payload_size
-                                 - sizeof(MallocMetadata);
+// record a successful call, if tracing
+inline void traceCall(SmallocTraceOp op, void* pointer, uint64_t argument,
+        size_t size) {
+    if (tracer.is_tracing.load(std::memory_order_relaxed) && pointer != NULL) {
+        tracer.record(op, pointer, argument, size);
     }
+}
 
-    if (remaining_payload_size >= SPLITTING_THRESHOLD) {
-        auto* remaining_block_metadata =
-                (MallocMetadata*)((char*)old_block_metadata
-                                  + sizeof(MallocMetadata)
-                                  + new_payload_size);
-        remaining_block_metadata->is_free = true;
-        remaining_block_metadata->size[ACTIVE_PAYLOAD] = 0;
-        remaining_block_metadata->size[TOTAL_PAYLOAD] = remaining_payload_size;
-        remaining_block_metadata->prev = old_block_metadata;
-        remaining_block_metadata->next = old_block_metadata->next;
+// ----------------------------------------------------------------------------
 
-        if (old_block_metadata == tail) {
-            tail = remaining_block_metadata;
-        } else {
-            old_block_metadata->next->prev = remaining_block_metadata;
-        }
-        old_block_metadata->next = remaining_block_metadata;
+/* fork() copies only the calling thread, so a lock held by another thread
+ * would stay locked in the child. Every lock is taken around fork() */
 
-        // blocks_count[TOTAL] doesn't change
-        // blocks_count[FREE] doesn't change
-        // bytes_count[TOTAL] doesn't change
-        bytes_count[FREE] -= original_succ_payload_size;
-        bytes_count[FREE] += remaining_payload_size;
-    } else {
-        blocks_count[TOTAL]--;
-        blocks_count[FREE]--;
-        // bytes_count[TOTAL] doesn't change
-        bytes_count[FREE] -= original_succ_payload_size;
-    }
+void lockAllBeforeFork() {
+    heap_profiler.lock.acquire();
+    memory_manager.lockAll();
+}
 
-    // no memmove needed
+void unlockAllAfterFork() {
+    memory_manager.unlockAll();
+    heap_profiler.lock.release();
+}
 
-    return old_block_metadata->getPayloadBlockAddr();
+void unlockAllInForkChild() {
+    unlockAllAfterFork();
+    tracer.resetAfterFork();
 }
 
-void *HeapBlocksList::reallocateUsingPredAndSucc(MallocMetadata *old_block_metadata,
-        size_t new_payload_size) {
-    // here pred and succ exists, free and large enough
+__attribute__((constructor)) void registerForkHandlers() {
+    pthread_atfork(lockAllBeforeFork, unlockAllAfterFork, unlockAllInForkChild);
+}
 
-    MallocMetadata* pred_metadata = old_block_metadata->prev;
-    MallocMetadata* succ_metadata = old_block_metadata->next;
-    size_t original_pred_payload_size = pred_metadata->size[TOTAL_PAYLOAD];
-    size_t original_succ_payload_size = succ_metadata->size[TOTAL_PAYLOAD];
+// ----------------------------------------------------------------------------
 
-    size_t total_avail_payload_size =
-            original_pred_payload_size
-            + sizeof(MallocMetadata) + old_block_metadata->size[TOTAL_PAYLOAD]
-            + sizeof(MallocMetadata) + original_succ_payload_size;
+// malloc family of functions implementations
 
-    pred_metadata->next = succ_metadata->next;
-    if (tail == succ_metadata) {
-        tail = pred_metadata;
-    } else {
-        succ_metadata->next->prev = pred_metadata;
+void* smalloc(size_t size) {
+    if (size == 0 || size > SMALLOC_MAX_SIZE) {
+        return NULL;
     }
 
-    pred_metadata->is_free = false;
-    pred_metadata->size[TOTAL_PAYLOAD] = total_avail_payload_size;
-    pred_metadata->size[ACTIVE_PAYLOAD] = new_payload_size;
+    void* p = memory_manager.allocateBlock(size);
+    profile_sampler.countAllocation(p, size);
+    traceCall(SMALLOC_TRACE_MALLOC, p, 0, size);
+    return p;
+}
 
-    size_t remaining_payload_size = 0;
-    if (total_avail_payload_size - new_payload_size > sizeof(MallocMetadata)) {
-        remaining_payload_size = total_avail_payload_size
-                                 - new_payload_size
-                                 - sizeof(MallocMetadata);
+void* scalloc(size_t num, size_t size) {
+    if (size == 0 || num == 0 || size > SMALLOC_MAX_SIZE
+        || num > SMALLOC_MAX_SIZE / size) {
+        return NULL;
     }
 
-    if (remaining_payload_size >= SPLITTING_THRESHOLD) {
-        auto* remaining_block_metadata =
-                (MallocMetadata*)((char*)pred_metadata
-                                  + sizeof(MallocMetadata)
-                                  + new_payload_size);
-        remaining_block_metadata->is_free = true;
-        remaining_block_metadata->size[ACTIVE_PAYLOAD] = 0;
-        remaining_block_metadata->size[TOTAL_PAYLOAD] = remaining_payload_size;
-        remaining_block_metadata->prev = pred_metadata;
-        remaining_block_metadata->next = pred_metadata->next;
-
-        if (pred_metadata == tail) {
-            tail = remaining_block_metadata;
-        } else {
-            pred_metadata->next->prev = remaining_block_metadata;
-        }
-        pred_metadata->next = remaining_block_metadata;
+    void* p = memory_manager.allocateZeroedBlock(size*num);
+    profile_sampler.countAllocation(p, size*num);
+    traceCall(SMALLOC_TRACE_CALLOC, p, 0, size*num);
+    return p;
+}
 
-        blocks_count[TOTAL] += -2 + 1;
-        blocks_count[FREE] += -2 + 1;
-        // bytes_count[TOTAL] doesn't change
-        bytes_count[FREE] -= original_pred_payload_size + original_succ_payload_size;
-        bytes_count[FREE] += remaining_payload_size;
-    } else {
-        blocks_count[TOTAL] -= 2;
-        blocks_count[FREE] -= 2;
-        // bytes_count[TOTAL] doesn't change
-        bytes_count[FREE] -= original_pred_payload_size + original_succ_payload_size;
+/* before @p is freed, so its address isn't sampled again meanwhile. srealloc()
+ * calls it once the block moved, when its old address may be reused: a
+ * sample taken there by another thread in between is lost */
+void releaseProfileSample(void* p) {
+    if (heap_profiler.live_samples_count.load(std::memory_order_relaxed) != 0) {
+        heap_profiler.releaseSample(p);
     }
-
-    memmove(pred_metadata->getPayloadBlockAddr(),
-           old_block_metadata->getPayloadBlockAddr(),
-           old_block_metadata->size[TOTAL_PAYLOAD]); // instead of ACTIVE_PAYLOAD
-
-    return pred_metadata->getPayloadBlockAddr();
 }
 
-void *HeapBlocksList::reallocateToOtherBlock(MallocMetadata *old_block_metadata,
-        void* old_payload_addr, size_t new_payload_size) {
-
-    MallocMetadata* free_block_metadata = findFreeBlock(new_payload_size);
-    void* new_payload_block_addr = NULL;
-
-    if (free_block_metadata == NULL) { // use sbrk
-        new_payload_block_addr = createNewBlock(new_payload_size);
-        if (new_payload_block_addr == NULL) {
-            // sbrk() failed
-            return NULL;
-        }
-    } else { // use free block
-        new_payload_block_addr = useFreeBlock(free_block_metadata,
-                                              new_payload_size);
+void sfree(void* p) {
+    if (p == NULL) {
+        return;
     }
 
-    memmove(new_payload_block_addr,
-           old_payload_addr,
-           old_block_metadata->size[TOTAL_PAYLOAD]); // instead of ACTIVE_PAYLOAD
-    releaseUsedBlock(old_payload_addr);
-
-    return new_payload_block_addr;
+    traceCall(SMALLOC_TRACE_FREE, p, 0, 0);
+    releaseProfileSample(p);
+    memory_manager.releaseUsedBlock(p);
 }
 
-// ----------------------------------------------------------------------------
-
-class MMappedBlocksManager{
-public:
-    size_t total_blocks_count;
-    size_t total_bytes_count;
+void ssized_free(void* p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
 
-    MMappedBlocksManager();
+    traceCall(SMALLOC_TRACE_FREE, p, 0, 0);
+    releaseProfileSample(p);
+    memory_manager.releaseSizedBlock(p, size);
+}
 
-    void* allocateBlock(size_t payload_size);
+size_t smalloc_batch(size_t size, size_t n, void** ptrs) {
+    if (size == 0 || n == 0 || size > SMALLOC_MAX_SIZE
+        || n > SMALLOC_MAX_SIZE / size) {
+        return 0;
+    }
 
-    void* createNewBlock(size_t payload_size);
+    size_t allocated_count = memory_manager.allocateBlocks(size, n, ptrs);
+    for (size_t i = 0; i < allocated_count; i++) {
+        profile_sampler.countAllocation(ptrs[i], size);
+        traceCall(SMALLOC_TRACE_MALLOC, ptrs[i], 0, size);
+    }
+    return allocated_count;
+}
 
-    void setNewBlockMetaData(size_t payload_size,
-            MallocMetadata* block_metadata);
+void sfree_batch(void** ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            traceCall(SMALLOC_TRACE_FREE, ptrs[i], 0, 0);
+            releaseProfileSample(ptrs[i]);
+        }
+    }
 
-    void releaseUsedBlock(void* payload_addr);
+    sortAddresses(ptrs, n);
+    memory_manager.releaseUsedBlocks(ptrs, n);
+}
 
-    void* reallocateActiveBlock(void* old_payload_addr,
-            size_t new_payload_size);
-};
+void* srealloc(void* oldp, size_t size) {
+    if (size == 0 || size > SMALLOC_MAX_SIZE) {
+        return NULL;
+    }
 
-// ----------------------------------------------------------------------------
+    if (oldp != NULL) {
+        traceCall(SMALLOC_TRACE_REALLOC_BEGIN, oldp, 0, size);
+    }
+    void* p = memory_manager.reallocateActiveBlock(oldp, size);
+    if (p != NULL) {
+        // on failure @oldp stays live, with its sample
+        if (oldp != NULL) {
+            // sampled again as a new allocation
+            releaseProfileSample(oldp);
+        }
+        profile_sampler.countAllocation(p, size);
+    }
+    traceCall(SMALLOC_TRACE_REALLOC, p != NULL ? p : oldp, (uintptr_t)oldp,
+              p != NULL ? size : 0);
+    return p;
+}
 
-MMappedBlocksManager::MMappedBlocksManager()
-        : total_blocks_count(0), total_bytes_count(0)
-{}
+size_t susable_size(void* p) {
+    if (p == NULL) {
+        return 0;
+    }
 
-void *MMappedBlocksManager::allocateBlock(size_t payload_size) {
-    // only option is to allocate a new block with mmap
-    return createNewBlock(payload_size);
+    return memory_manager.getUsableSize(p);
 }
 
-void *MMappedBlocksManager::createNewBlock(size_t payload_size) {
-    size_t needed_allocation_size = payload_size + sizeof(MallocMetadata);
+bool isValidAlignment(size_t alignment) {
+    return alignment != 0 && (alignment & (alignment - 1)) == 0
+           && alignment <= SMALLOC_MAX_SIZE;
+}
 
-    /* If total_needed_size isn't a page size multiple, it will be rounded up
-     * to page size multiple */
-    void* block_addr = mmap(NULL, needed_allocation_size,
-                            PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS,
-                            -1,
-                            0);
-    if (block_addr == (void*)-1) {
-        // mmap failed
+void* saligned_alloc(size_t alignment, size_t size) {
+    if (size == 0 || size > SMALLOC_MAX_SIZE || !isValidAlignment(alignment)) {
         return NULL;
     }
 
-    auto* metadata_addr = (MallocMetadata*)block_addr;
-    setNewBlockMetaData(payload_size, metadata_addr);
+    void* p = memory_manager.allocateAlignedBlock(alignment, size);
+    profile_sampler.countAllocation(p, size);
+    traceCall(SMALLOC_TRACE_ALIGNED_ALLOC, p, alignment, size);
+    return p;
+}
 
-    total_blocks_count++;
-    total_bytes_count += needed_allocation_size; // including metadata
+int sposix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (!isValidAlignment(alignment) || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        // like smalloc(0)
+        *memptr = NULL;
+        return 0;
+    }
+    if (size > SMALLOC_MAX_SIZE) {
+        return ENOMEM;
+    }
 
-    return metadata_addr->getPayloadBlockAddr();
-}
+    void* payload_addr = memory_manager.allocateAlignedBlock(alignment, size);
+    if (payload_addr == NULL) {
+        return ENOMEM;
+    }
+    profile_sampler.countAllocation(payload_addr, size);
+    traceCall(SMALLOC_TRACE_ALIGNED_ALLOC, payload_addr, alignment, size);
 
-void MMappedBlocksManager::setNewBlockMetaData(size_t payload_size,
-        MallocMetadata *block_metadata) {
-    block_metadata->size[TOTAL_PAYLOAD] = payload_size;
-    block_metadata->size[ACTIVE_PAYLOAD] = payload_size;
+    *memptr = payload_addr;
+    return 0;
 }
 
-void MMappedBlocksManager::releaseUsedBlock(void *payload_addr) {
-    // here payload_addr != NULL
+void* smemalign(size_t alignment, size_t size) {
+    return saligned_alloc(alignment, size);
+}
 
-    auto* block_metadata = (MallocMetadata*)payload_addr - 1;
+int smallopt(int param, int value) {
+    switch (param) {
+        case M_ARENA_MAX:
+            return memory_manager.setArenasCount(value);
+        case M_TRIM_THRESHOLD:
+            return memory_manager.setTrimThreshold(value);
+        case M_MMAP_CACHE_MAX:
+            return memory_manager.setMMapCacheMaxBytes(value);
+        case M_HEAP_GROWTH_MIN:
+        case M_HEAP_GROWTH_MAX:
+            return memory_manager.setHeapGrowthSize((SmalloptParam)param, value);
+        case M_HUGE_PAGES:
+            return memory_manager.setHugePagesMode(value);
+        case M_HEAP_HUGE_PAGES:
+            return memory_manager.setHeapHugePages(value);
+        case M_PROFILE_SAMPLE_RATE:
+            return heap_profiler.setSampleRate(value);
+        case M_MMAP_THRESHOLD:
+        case M_MMAP_THRESHOLD_MIN:
+        case M_MMAP_THRESHOLD_MAX:
+            return memory_manager.setMMapThreshold((SmalloptParam)param, value);
+        default:
+            return 0;
+    }
+}
 
-    size_t block_size = block_metadata->size[TOTAL_PAYLOAD]
-                        + sizeof(MallocMetadata);
-    munmap((void*)block_metadata, block_size);
-    total_blocks_count--;
-    total_bytes_count -= block_size;
+int smalloc_trim(size_t pad) {
+    return memory_manager.trimHeaps(pad);
 }
 
-void *MMappedBlocksManager::reallocateActiveBlock(void *old_payload_addr,
-        size_t new_payload_size) {
-    MallocMetadata* old_block_metadata = NULL;
-    if (old_payload_addr != NULL) {
-        old_block_metadata = (MallocMetadata*)old_payload_addr - 1;
+int sreserve(size_t bytes) {
+    if (bytes > 1e9) {
+        return 0;
     }
 
-    // always reallocate to a new block
-    void* new_payload_addr = allocateBlock(new_payload_size);
-    if (new_payload_addr != NULL && old_payload_addr != NULL) {
-        memmove(new_payload_addr, old_payload_addr,
-                min(new_payload_size, old_block_metadata->size[ACTIVE_PAYLOAD]));
-        releaseUsedBlock(old_payload_addr);
-    }
+    return memory_manager.reserveHeap(bytes);
+}
 
-    return new_payload_addr;
+int smalloc_trace_start(int fd) {
+    return tracer.start(fd);
+}
+
+int smalloc_trace_stop() {
+    return tracer.stop();
 }
 
 // ----------------------------------------------------------------------------
 
-class MemoryManager {
-public:
-    HeapBlocksList heap_blocks_list;
-    MMappedBlocksManager mmapped_blocks;
+// statistics implementation
 
-    void* allocateBlock(size_t payload_size);
+// formats into a buffer on the stack, as printing mustn't allocate
+class StatsWriter {
+public:
+    int fd;
+    char buffer[256];
+    size_t length;
+    bool failed;
 
-    void* allocateZeroedBlock(size_t payload_size);
+    explicit StatsWriter(int fd);
 
-    void releaseUsedBlock(void* payload_addr);
+    void writeString(const char* string);
 
-    void* reallocateActiveBlock(void* old_payload_addr, size_t new_payload_size);
+    void writeNumber(size_t number);
 
-    size_t getBlocksCount(BytesType type);
+    void writeHexNumber(size_t number);
 
-    size_t getBytesCount(BytesType type);
+    // write @prefix, @number and @suffix
+    void writeField(const char* prefix, size_t number, const char* suffix);
 
-    size_t getMetaDataSize();
+    // return false if any write to the fd failed
+    bool flush();
 };
 
-void *MemoryManager::allocateBlock(size_t payload_size) {
-    if (payload_size >= 128 * KB) {
-        return mmapped_blocks.allocateBlock(payload_size);
-    } else {
-        return heap_blocks_list.allocateBlock(payload_size);
+StatsWriter::StatsWriter(int fd) : fd(fd), length(0), failed(false) {}
+
+void StatsWriter::writeString(const char *string) {
+    for (; *string != '\0'; string++) {
+        if (length == sizeof(buffer)) {
+            flush();
+        }
+        buffer[length++] = *string;
     }
 }
 
-void *MemoryManager::allocateZeroedBlock(size_t payload_size) {
-    if (payload_size >= 128 * KB) {
-        return mmapped_blocks.allocateBlock(payload_size);
-    } else {
-        return heap_blocks_list.allocateZeroedBlock(payload_size);
-    }
+void StatsWriter::writeNumber(size_t number) {
+    char digits[24];
+    size_t digits_count = sizeof(digits) - 1;
+    digits[digits_count] = '\0';
+    do {
+        digits[--digits_count] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number != 0);
+
+    writeString(digits + digits_count);
 }
 
-void MemoryManager::releaseUsedBlock(void *payload_addr) {
-    auto* block_metadata = (MallocMetadata*)payload_addr - 1;
+void StatsWriter::writeHexNumber(size_t number) {
+    char digits[24];
+    size_t digits_count = sizeof(digits) - 1;
+    digits[digits_count] = '\0';
+    do {
+        digits[--digits_count] = "0123456789abcdef"[number % 16];
+        number /= 16;
+    } while (number != 0);
+    digits[--digits_count] = 'x';
+    digits[--digits_count] = '0';
+
+    writeString(digits + digits_count);
+}
 
-    if (block_metadata->size[ACTIVE_PAYLOAD] < 128 * KB) {
-        heap_blocks_list.releaseUsedBlock(payload_addr);
-    } else {
-        mmapped_blocks.releaseUsedBlock(payload_addr);
-    }
+void StatsWriter::writeField(const char *prefix, size_t number,
+        const char *suffix) {
+    writeString(prefix);
+    writeNumber(number);
+    writeString(suffix);
 }
 
-void *MemoryManager::reallocateActiveBlock(void *old_payload_addr,
-        size_t new_payload_size) {
-    if (new_payload_size >= 128 * KB) {
-        return mmapped_blocks.reallocateActiveBlock(old_payload_addr,
-                new_payload_size);
-    } else {
-        return heap_blocks_list.reallocateActiveBlock(old_payload_addr,
-                new_payload_size);
+bool StatsWriter::flush() {
+    size_t written_length = 0;
+    while (written_length < length && !failed) {
+        ssize_t result = write(fd, buffer + written_length,
+                               length - written_length);
+        if (result < 0 && errno != EINTR) {
+            failed = true;
+        } else if (result > 0) {
+            written_length += result;
+        }
     }
+    length = 0;
+
+    return !failed;
 }
 
-size_t MemoryManager::getBlocksCount(BytesType type) {
-    if (type == FREE) {
-        return heap_blocks_list.blocks_count[FREE];
-    } else {
-        return heap_blocks_list.blocks_count[TOTAL]
-               + mmapped_blocks.total_blocks_count;
+void printTierStatsText(StatsWriter& writer, const char* name,
+        SmallocTierStats& tier_stats) {
+    writer.writeString(name);
+    writer.writeField(": used ", tier_stats.used_blocks, " blocks");
+    writer.writeField(" / ", tier_stats.used_bytes, " bytes");
+    writer.writeField(", free ", tier_stats.free_blocks, " blocks");
+    writer.writeField(" / ", tier_stats.free_bytes, " bytes\n");
+}
+
+void printStatsText(StatsWriter& writer, SmallocStats& stats) {
+    printTierStatsText(writer, "heap", stats.heap);
+    printTierStatsText(writer, "mmapped", stats.mmapped);
+    printTierStatsText(writer, "slab", stats.slab);
+    writer.writeField("largest free heap block: ", stats.largest_free_block,
+                      " bytes\n");
+    writer.writeField("heap top: ", stats.heap_top_bytes, " bytes\n");
+
+    writer.writeString("size classes (payload: used blocks / free blocks):\n");
+    for (size_t i = 0; i < SMALLOC_STATS_SIZE_CLASSES_COUNT; i++) {
+        if (stats.used_blocks_by_size_class[i] == 0
+            && stats.free_blocks_by_size_class[i] == 0) {
+            continue;
+        }
+        if (i < SMALLOC_STATS_SIZE_CLASSES_COUNT - 1) {
+            writer.writeField("  <= ", (size_t)16 << i, ": ");
+        } else {
+            writer.writeField("  > ", (size_t)8 << i, ": ");
+        }
+        writer.writeField("", stats.used_blocks_by_size_class[i], " / ");
+        writer.writeField("", stats.free_blocks_by_size_class[i], "\n");
     }
+
+    writer.writeField("splits: ", stats.splits_count, "\n");
+    writer.writeField("coalesces: ", stats.coalesces_count, "\n");
+    writer.writeField("system calls: sbrk ", stats.sbrk_calls_count, "");
+    writer.writeField(", mmap ", stats.mmap_calls_count, "");
+    writer.writeField(", munmap ", stats.munmap_calls_count, "");
+    writer.writeField(", mremap ", stats.mremap_calls_count, "");
+    writer.writeField(", mprotect ", stats.mprotect_calls_count, "");
+    writer.writeField(", madvise ", stats.madvise_calls_count, "\n");
+    writer.writeField("peak RSS: ", stats.peak_rss_bytes, " bytes\n");
 }
 
-size_t MemoryManager::getBytesCount(BytesType type) {
-    if (type == FREE) {
-        return heap_blocks_list.bytes_count[FREE];
-    } else {
-        return heap_blocks_list.bytes_count[TOTAL] + mmapped_blocks.total_bytes_count
-               - _num_meta_data_bytes();
+void printTierStatsJson(StatsWriter& writer, const char* name,
+        SmallocTierStats& tier_stats) {
+    writer.writeString("\"");
+    writer.writeString(name);
+    writer.writeField("\": {\"used_blocks\": ", tier_stats.used_blocks, ", ");
+    writer.writeField("\"used_bytes\": ", tier_stats.used_bytes, ", ");
+    writer.writeField("\"free_blocks\": ", tier_stats.free_blocks, ", ");
+    writer.writeField("\"free_bytes\": ", tier_stats.free_bytes, "}, ");
+}
+
+void printStatsJson(StatsWriter& writer, SmallocStats& stats) {
+    writer.writeString("{");
+    printTierStatsJson(writer, "heap", stats.heap);
+    printTierStatsJson(writer, "mmapped", stats.mmapped);
+    printTierStatsJson(writer, "slab", stats.slab);
+    writer.writeField("\"largest_free_block\": ", stats.largest_free_block,
+                      ", ");
+    writer.writeField("\"heap_top_bytes\": ", stats.heap_top_bytes, ", ");
+
+    // the last class has no max payload
+    writer.writeString("\"size_classes\": [");
+    for (size_t i = 0; i < SMALLOC_STATS_SIZE_CLASSES_COUNT; i++) {
+        if (i < SMALLOC_STATS_SIZE_CLASSES_COUNT - 1) {
+            writer.writeField("{\"max_payload\": ", (size_t)16 << i, ", ");
+        } else {
+            writer.writeString("{\"max_payload\": null, ");
+        }
+        writer.writeField("\"used_blocks\": ",
+                          stats.used_blocks_by_size_class[i], ", ");
+        writer.writeField("\"free_blocks\": ",
+                          stats.free_blocks_by_size_class[i],
+                          i < SMALLOC_STATS_SIZE_CLASSES_COUNT - 1 ? "}, " : "}");
     }
+    writer.writeString("], ");
+
+    writer.writeField("\"splits\": ", stats.splits_count, ", ");
+    writer.writeField("\"coalesces\": ", stats.coalesces_count, ", ");
+    writer.writeField("\"system_calls\": {\"sbrk\": ", stats.sbrk_calls_count,
+                      ", ");
+    writer.writeField("\"mmap\": ", stats.mmap_calls_count, ", ");
+    writer.writeField("\"munmap\": ", stats.munmap_calls_count, ", ");
+    writer.writeField("\"mremap\": ", stats.mremap_calls_count, ", ");
+    writer.writeField("\"mprotect\": ", stats.mprotect_calls_count, ", ");
+    writer.writeField("\"madvise\": ", stats.madvise_calls_count, "}, ");
+    writer.writeField("\"peak_rss_bytes\": ", stats.peak_rss_bytes, "}\n");
 }
 
-size_t MemoryManager::getMetaDataSize() {
-    return sizeof(MallocMetadata);
+SmallocStats smalloc_stats() {
+    SmallocStats stats;
+    memory_manager.getStats(stats);
+
+    return stats;
 }
 
-// ----------------------------------------------------------------------------
+int smalloc_stats_print(int fd, SmallocStatsFormat format) {
+    if (format != SMALLOC_STATS_TEXT && format != SMALLOC_STATS_JSON) {
+        return 0;
+    }
 
-MemoryManager memory_manager;
+    SmallocStats stats = smalloc_stats();
 
-// malloc family of functions implementations
+    StatsWriter writer(fd);
+    if (format == SMALLOC_STATS_TEXT) {
+        printStatsText(writer, stats);
+    } else {
+        printStatsJson(writer, stats);
+    }
 
-void* smalloc(size_t size) {
-    if (size == 0 || size > 1e8) {
-        return NULL;
+    return writer.flush();
+}
+
+SmallocFragmentation smalloc_fragmentation() {
+    SmallocFragmentation fragmentation;
+    memory_manager.getFragmentation(fragmentation);
+
+    return fragmentation;
+}
+
+// write a run of @blocks_count blocks of @bytes bytes, if any
+void printHeapMapRun(StatsWriter& writer, bool is_free, size_t blocks_count,
+        size_t bytes) {
+    if (blocks_count == 0) {
+        return;
     }
 
-    return memory_manager.allocateBlock(size);
+    writer.writeString(is_free ? " F" : " U");
+    writer.writeField("", blocks_count, ":");
+    writer.writeNumber(bytes);
 }
 
-void* scalloc(size_t num, size_t size) {
-    if (size == 0 || num == 0 || size > 1e8 || num > 1e8 || size*num > 1e8) {
-        return NULL;
+void printHeapMap(StatsWriter& writer, HeapBlocksList& heap_blocks_list) {
+    writer.writeString("heap ");
+    writer.writeHexNumber((uintptr_t)heap_blocks_list.head);
+    writer.writeString(":");
+
+    bool is_run_free = false;
+    size_t run_blocks_count = 0;
+    size_t run_bytes = 0;
+    for (MallocMetadata* block_metadata = heap_blocks_list.head;
+         block_metadata != NULL;
+         block_metadata = heap_blocks_list.getSuccBlock(block_metadata)) {
+        bool is_free = block_metadata->hasFlag(FREE_FLAG);
+        if (is_free != is_run_free) {
+            printHeapMapRun(writer, is_run_free, run_blocks_count, run_bytes);
+            is_run_free = is_free;
+            run_blocks_count = 0;
+            run_bytes = 0;
+        }
+        run_blocks_count++;
+        run_bytes += block_metadata->getBlockSize();
     }
+    printHeapMapRun(writer, is_run_free, run_blocks_count, run_bytes);
 
-    return memory_manager.allocateZeroedBlock(size*num);
+    writer.writeField(" T:", heap_blocks_list.top_size, "\n");
 }
 
-void sfree(void* p) {
-    if (p == NULL) {
-        return;
+int smalloc_heap_map_print(int fd) {
+    StatsWriter writer(fd);
+
+    for (size_t i = 0; i < MAX_ARENAS_COUNT; i++) {
+        Arena& arena = memory_manager.arenas[i];
+        LockGuard guard(arena.lock);
+        arena.releaseRemoteFreedBlocks();
+        if (arena.heap_blocks_list.head != NULL) {
+            printHeapMap(writer, arena.heap_blocks_list);
+        }
     }
 
-    memory_manager.releaseUsedBlock(p);
+    return writer.flush();
 }
 
-void* srealloc(void* oldp, size_t size) {
-    if (size == 0 || size > 1e8) {
-        return NULL;
+int smalloc_profile_print(int fd, SmallocProfileType type) {
+    if (type != SMALLOC_PROFILE_LIVE && type != SMALLOC_PROFILE_ALLOCATED) {
+        return 0;
     }
 
-    return memory_manager.reallocateActiveBlock(oldp, size);
+    StatsWriter writer(fd);
+
+    LockGuard guard(heap_profiler.lock);
+    for (size_t i = 0; heap_profiler.stacks != NULL
+                       && i < PROFILE_STACKS_COUNT; i++) {
+        ProfileStack& stack = heap_profiler.stacks[i];
+        size_t bytes = type == SMALLOC_PROFILE_LIVE ? stack.live_bytes
+                                                    : stack.allocated_bytes;
+        if (stack.depth == 0 || bytes == 0) {
+            continue;
+        }
+
+        for (size_t j = stack.depth; j > 0; j--) {
+            writer.writeHexNumber((uintptr_t)stack.frames[j - 1]);
+            writer.writeString(j > 1 ? ";" : " ");
+        }
+        writer.writeField("", bytes, "\n");
+    }
+
+    return writer.flush();
 }
 
 // ----------------------------------------------------------------------------
@@ -1079,9 +5551,13 @@ size_t _num_allocated_bytes() {
 }
 
 size_t _num_meta_data_bytes() {
-    return memory_manager.getBlocksCount(TOTAL) * memory_manager.getMetaDataSize();
+    return memory_manager.getMetaDataBytesCount();
 }
 
 size_t _size_meta_data() {
     return memory_manager.getMetaDataSize();
 }
+
+size_t _num_huge_page_bytes() {
+    return memory_manager.getHugePageBytesCount();
+}
@@ -0,0 +1,278 @@
+/* the standard malloc interface on top of malloc_3.cpp, as a shared library
+ * that replaces the malloc of a program without rebuilding it:
+ *
+ *     g++ -std=c++17 -O2 -fPIC -shared -pthread malloc_preload.cpp \
+ *         -o libsmalloc.so
+ *     LD_PRELOAD=./libsmalloc.so program
+ *
+ * The allocator is constant initialized, so it works for the dynamic linker
+ * and libc before any constructor runs. Pointers it didn't allocate, like
+ * those of the dynamic linker's own early allocator, are never freed */
+
+// system headers first, so only the allocator is hidden below
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <execinfo.h>
+#include <math.h>
+#include <sched.h>
+#include <atomic>
+#include <new>
+
+// what glibc allows
+#define SMALLOC_MAX_SIZE PTRDIFF_MAX
+
+/* only the SMALLOC_EXPORT functions are exported, so the allocator's own
+ * functions don't interpose those of the program */
+#pragma GCC visibility push(hidden)
+#include "malloc_3.cpp"
+
+#define SMALLOC_EXPORT extern "C" __attribute__((visibility("default")))
+#define SMALLOC_EXPORT_CXX __attribute__((visibility("default")))
+
+// ----------------------------------------------------------------------------
+
+SMALLOC_EXPORT void* malloc(size_t size) {
+    // libc returns a unique pointer for 0 bytes
+    void* p = smalloc(size != 0 ? size : 1);
+    if (p == NULL) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+SMALLOC_EXPORT void* calloc(size_t num, size_t size) {
+    if (num == 0 || size == 0) {
+        num = 1;
+        size = 1;
+    }
+
+    void* p = scalloc(num, size);
+    if (p == NULL) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+SMALLOC_EXPORT void free(void* p) {
+    if (p != NULL && memory_manager.ownsBlock(p)) {
+        sfree(p);
+    }
+}
+
+SMALLOC_EXPORT void* realloc(void* oldp, size_t size) {
+    if (oldp != NULL && size == 0) {
+        free(oldp);
+        return NULL;
+    }
+    if (oldp == NULL || memory_manager.ownsBlock(oldp)) {
+        void* p = srealloc(oldp, size != 0 ? size : 1);
+        if (p == NULL) {
+            errno = ENOMEM;
+        }
+        return p;
+    }
+
+    /* the size of a foreign block is unknown. Copy up to the end of its page,
+     * which is surely mapped, and leave the block to its allocator */
+    void* p = malloc(size);
+    if (p != NULL) {
+        size_t page_size = getpagesize();
+        size_t readable_size = page_size - (uintptr_t)oldp % page_size;
+        memcpy(p, oldp, min(size, readable_size));
+    }
+    return p;
+}
+
+SMALLOC_EXPORT int posix_memalign(void** memptr, size_t alignment,
+        size_t size) {
+    return sposix_memalign(memptr, alignment, size != 0 ? size : 1);
+}
+
+SMALLOC_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    if (!isValidAlignment(alignment)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void* p = saligned_alloc(alignment, size != 0 ? size : 1);
+    if (p == NULL) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+SMALLOC_EXPORT void* memalign(size_t alignment, size_t size) {
+    // like glibc, round the alignment up to a power of 2
+    size_t power_of_2_alignment = 1;
+    while (power_of_2_alignment < alignment
+           && power_of_2_alignment <= SMALLOC_MAX_SIZE / 2) {
+        power_of_2_alignment *= 2;
+    }
+
+    return aligned_alloc(power_of_2_alignment, size);
+}
+
+SMALLOC_EXPORT void* valloc(size_t size) {
+    return memalign(getpagesize(), size);
+}
+
+SMALLOC_EXPORT void* pvalloc(size_t size) {
+    size_t page_size = getpagesize();
+    if (size > SMALLOC_MAX_SIZE - page_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return memalign(page_size, (size + page_size - 1) / page_size * page_size);
+}
+
+SMALLOC_EXPORT size_t malloc_usable_size(void* p) {
+    if (p == NULL || !memory_manager.ownsBlock(p)) {
+        return 0;
+    }
+
+    return susable_size(p);
+}
+
+SMALLOC_EXPORT int malloc_trim(size_t pad) {
+    return smalloc_trim(pad);
+}
+
+// ----------------------------------------------------------------------------
+
+/* operator new calls the new handler until allocating succeeds. @alignment
+ * is 0 for the operators without one */
+void* allocateForNew(size_t size, size_t alignment) {
+    for (;;) {
+        void* p = alignment <= BLOCK_SIZE_ALIGNMENT
+                  ? malloc(size) : aligned_alloc(alignment, size);
+        if (p != NULL) {
+            return p;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == NULL) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void* allocateForNewNoThrow(size_t size, size_t alignment) {
+    try {
+        return allocateForNew(size, alignment);
+    } catch (...) {
+        return NULL;
+    }
+}
+
+SMALLOC_EXPORT_CXX void* operator new(size_t size) {
+    return allocateForNew(size, 0);
+}
+
+SMALLOC_EXPORT_CXX void* operator new[](size_t size) {
+    return allocateForNew(size, 0);
+}
+
+SMALLOC_EXPORT_CXX void* operator new(size_t size,
+        const std::nothrow_t&) noexcept {
+    return allocateForNewNoThrow(size, 0);
+}
+
+SMALLOC_EXPORT_CXX void* operator new[](size_t size,
+        const std::nothrow_t&) noexcept {
+    return allocateForNewNoThrow(size, 0);
+}
+
+SMALLOC_EXPORT_CXX void operator delete(void* p) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete(void* p,
+        const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete[](void* p,
+        const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+#if __cpp_sized_deallocation
+void releaseSizedForDelete(void* p, size_t size) {
+    if (p != NULL && memory_manager.ownsBlock(p)) {
+        ssized_free(p, size != 0 ? size : 1);
+    }
+}
+
+SMALLOC_EXPORT_CXX void operator delete(void* p, size_t size) noexcept {
+    releaseSizedForDelete(p, size);
+}
+
+SMALLOC_EXPORT_CXX void operator delete[](void* p, size_t size) noexcept {
+    releaseSizedForDelete(p, size);
+}
+#endif
+
+#if __cpp_aligned_new
+SMALLOC_EXPORT_CXX void* operator new(size_t size,
+        std::align_val_t alignment) {
+    return allocateForNew(size, (size_t)alignment);
+}
+
+SMALLOC_EXPORT_CXX void* operator new[](size_t size,
+        std::align_val_t alignment) {
+    return allocateForNew(size, (size_t)alignment);
+}
+
+SMALLOC_EXPORT_CXX void* operator new(size_t size, std::align_val_t alignment,
+        const std::nothrow_t&) noexcept {
+    return allocateForNewNoThrow(size, (size_t)alignment);
+}
+
+SMALLOC_EXPORT_CXX void* operator new[](size_t size,
+        std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocateForNewNoThrow(size, (size_t)alignment);
+}
+
+SMALLOC_EXPORT_CXX void operator delete(void* p, std::align_val_t) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete[](void* p, std::align_val_t) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete(void* p, std::align_val_t,
+        const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete[](void* p, std::align_val_t,
+        const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete(void* p, size_t,
+        std::align_val_t) noexcept {
+    free(p);
+}
+
+SMALLOC_EXPORT_CXX void operator delete[](void* p, size_t,
+        std::align_val_t) noexcept {
+    free(p);
+}
+#endif
+
+#pragma GCC visibility pop